@@ -1,292 +1,1789 @@
+#include <algorithm>
+#include <cstdarg>
 #include <cstring>
 #include <cstddef>
 #include <atomic>
 #include <new>
 
+#include <cstdio>
+#include <cstdlib>
+
+#include <dlfcn.h>
 #include <sys/mman.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <unistd.h>
 
-#define DEBUG
+#define DEBUG
+
+#ifdef DEBUG
+#include <iostream>
+#include <fstream>
+#endif
+
+#include "jp_alloc.h"
+	
+#ifndef JP_ALLOC_POOL_COUNT
+#define JP_ALLOC_POOL_COUNT 16
+#endif
+
+// .bss arena the first pool reservations are carved from, 0 to disable
+#ifndef JP_ALLOC_BOOTSTRAP_SIZE
+#define JP_ALLOC_BOOTSTRAP_SIZE (256 * 1024)
+#endif
+
+// bytes of freed page allocations kept per CPU for reuse, 0 to disable
+#ifndef JP_ALLOC_PAGE_CACHE
+#define JP_ALLOC_PAGE_CACHE (4 << 20)
+#endif
+
+// operator new callsites remembered with their size class, e.g. 1024. Off by
+// default, computing the class measured as fast (tools/bench_new.cpp)
+// interpose exit and __libc_start_main for jp_fast_exit_on_exit, 0 to leave
+// them alone, then fast exit can only be started by calling jp_fast_exit
+#ifndef JP_ALLOC_EXIT_HOOKS
+#define JP_ALLOC_EXIT_HOOKS 1
+#endif
+
+#ifndef JP_ALLOC_SITE_CACHE
+#define JP_ALLOC_SITE_CACHE 0
+#endif
+
+namespace {
+
+using jp::header;
+
+unsigned long long now_ns()
+{
+   timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Flight recorder
+
+std::atomic<jp_flight*> g_flight;
+
+constexpr size_t flight_bytes = sizeof(jp_flight) + (JP_FLIGHT_EVENTS - 1) * sizeof(jp_flight_event);
+
+jp_flight *flight_get()
+{
+   jp_flight *f = g_flight.load(std::memory_order_acquire);
+   if (likely(f != nullptr)) return f;
+   const size_t bytes = flight_bytes;
+   int fd = memfd_create("jp_alloc_flight", MFD_CLOEXEC);
+   void *mem = MAP_FAILED;
+   if (fd >= 0 && ftruncate(fd, bytes) == 0) mem = mmap(0, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   if (mem == MAP_FAILED) mem = mmap(0, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if (mem == MAP_FAILED) {
+      if (fd >= 0) close(fd);
+      return nullptr;
+   }
+   f = static_cast<jp_flight*>(mem);
+   memcpy(f->magic, "JPFLIGHT", 8);
+   f->capacity = JP_FLIGHT_EVENTS;
+   jp_flight *expected = nullptr;
+   if (!g_flight.compare_exchange_strong(expected, f)) {
+      // another thread got there first
+      munmap(mem, bytes);
+      if (fd >= 0) close(fd);
+      return expected;
+   }
+   jp_flight_recorder = f;
+   return f;
+}
+
+// The ring is a shared mapping, so a forked child would keep writing into
+// its parent's. The child drops it and maps its own on its next event.
+void flight_fork_child()
+{
+   if (jp_flight *f = g_flight.load(std::memory_order_relaxed)) munmap(f, flight_bytes);
+   g_flight.store(nullptr, std::memory_order_relaxed);
+   jp_flight_recorder = nullptr;
+}
+
+int _flight_fork = pthread_atfork(nullptr, nullptr, flight_fork_child);
+
+void ring_record(jp_flight *f, jp_flight_type type, size_t size, void *addr)
+{
+   unsigned long n = f->next.fetch_add(1, std::memory_order_relaxed);
+   jp_flight_event &e = f->events[n % f->capacity];
+   e.seq.store(0, std::memory_order_relaxed);
+   e.ns = now_ns();
+   e.type = type;
+   e.tid = syscall(SYS_gettid);
+   e.size = size;
+   e.addr = addr;
+   e.seq.store(n + 1, std::memory_order_release);
+}
+
+void flight_record(jp_flight_type type, size_t size, void *addr)
+{
+   jp_flight *f = flight_get();
+   if (f != nullptr) ring_record(f, type, size, addr);
+}
+
+// Page population
+
+struct {
+   jp_populate_config config;
+   std::atomic<bool> enabled;
+   bool madvise; // kernel supports MADV_POPULATE_WRITE
+   std::atomic<unsigned long long> last_reserve;
+   pthread_t thread;
+   bool running;
+   bool stop;
+   struct {
+      void *mem;
+      size_t bytes;
+   } queue[64];
+   size_t head, tail;
+} g_populate;
+
+pthread_mutex_t g_populate_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t g_populate_cond = PTHREAD_COND_INITIALIZER;
+
+// true if this reservation should be prefaulted
+bool populate_wanted()
+{
+   if (likely(!g_populate.enabled.load(std::memory_order_relaxed))) return false;
+   unsigned long long now = now_ns();
+   unsigned long long last = g_populate.last_reserve.exchange(now, std::memory_order_relaxed);
+   return now - last < g_populate.config.window_us * 1000ULL;
+}
+
+void populate(void *mem, size_t size)
+{
+   if (!g_populate.config.background) {
+      madvise(mem, size, MADV_POPULATE_WRITE);
+      return;
+   }
+   pthread_mutex_lock(&g_populate_mutex);
+   size_t next = (g_populate.tail + 1) % 64;
+   if (next != g_populate.head) { // else full, pages just fault in on use
+      g_populate.queue[g_populate.tail] = { mem, size };
+      g_populate.tail = next;
+      pthread_cond_signal(&g_populate_cond);
+   }
+   pthread_mutex_unlock(&g_populate_mutex);
+}
+
+void *populate_thread(void *)
+{
+   pthread_mutex_lock(&g_populate_mutex);
+   while (!g_populate.stop) {
+      if (g_populate.head == g_populate.tail) {
+         pthread_cond_wait(&g_populate_cond, &g_populate_mutex);
+         continue;
+      }
+      auto span = g_populate.queue[g_populate.head];
+      g_populate.head = (g_populate.head + 1) % 64;
+      pthread_mutex_unlock(&g_populate_mutex);
+      // pool spans are never unmapped, so this can't race with munmap
+      madvise(span.mem, span.bytes, MADV_POPULATE_WRITE);
+      pthread_mutex_lock(&g_populate_mutex);
+   }
+   pthread_mutex_unlock(&g_populate_mutex);
+   return nullptr;
+}
+
+// Huge page collapse
+
+#ifndef MADV_COLLAPSE
+#define MADV_COLLAPSE 25
+#endif
+
+constexpr size_t huge_page_size = 2 << 20;
+constexpr size_t collapse_regions = 8192; // 16 GB of pool spans
+
+struct collapse_region
+{
+   uintptr_t base;
+   size_t covered; // bytes of pool spans in the region
+   unsigned long long full_ns; // when covered reached huge_page_size
+   enum : unsigned char { pending, done, failed } state;
+};
+
+struct {
+   jp_collapse_config config;
+   collapse_region regions[collapse_regions]; // open addressing on base
+   std::atomic<unsigned long> promoted;
+   pthread_t thread;
+   std::atomic<bool> running;
+   std::atomic<bool> stop;
+} g_collapse;
+
+pthread_mutex_t g_collapse_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// account a new pool span to the regions it overlaps
+void collapse_note(void *mem, size_t size)
+{
+   const uintptr_t begin = reinterpret_cast<uintptr_t>(mem), end = begin + size;
+   pthread_mutex_lock(&g_collapse_mutex);
+   for (uintptr_t base = begin & ~(huge_page_size - 1); base < end; base += huge_page_size) {
+      size_t i = (base / huge_page_size * 0x9e3779b97f4a7c15ULL) % collapse_regions;
+      size_t probes = 0;
+      while (g_collapse.regions[i].base != 0 && g_collapse.regions[i].base != base && ++probes < collapse_regions) i = (i + 1) % collapse_regions;
+      if (probes == collapse_regions) break; // table full, the rest just isn't collapsed
+      collapse_region &r = g_collapse.regions[i];
+      r.base = base;
+      r.covered += std::min(end, base + huge_page_size) - std::max(begin, base);
+      if (r.covered == huge_page_size) r.full_ns = now_ns();
+   }
+   pthread_mutex_unlock(&g_collapse_mutex);
+}
+
+// percent of the region's pages resident
+unsigned collapse_density(uintptr_t base)
+{
+   const size_t ps = sysconf(_SC_PAGESIZE), n = huge_page_size / ps;
+   unsigned char vec[huge_page_size / 4096];
+   if (mincore(reinterpret_cast<void*>(base), huge_page_size, vec) != 0) return 0;
+   size_t resident = 0;
+   for (size_t i = 0; i < n; ++i) resident += vec[i] & 1;
+   return resident * 100 / n;
+}
+
+void *collapse_thread(void *)
+{
+   const jp_collapse_config &c = g_collapse.config;
+   while (!g_collapse.stop) {
+      const unsigned long long now = now_ns();
+      for (collapse_region &r : g_collapse.regions) {
+         if (g_collapse.stop) break;
+         pthread_mutex_lock(&g_collapse_mutex);
+         const bool ready = r.state == collapse_region::pending && r.covered == huge_page_size && now - r.full_ns >= c.min_age_ms * 1000000ULL;
+         pthread_mutex_unlock(&g_collapse_mutex);
+         if (!ready || collapse_density(r.base) < c.min_density) continue;
+         void *mem = reinterpret_cast<void*>(r.base);
+         if (madvise(mem, huge_page_size, MADV_COLLAPSE) == 0) {
+            r.state = collapse_region::done;
+            g_collapse.promoted.fetch_add(1, std::memory_order_relaxed);
+            flight_record(jp_flight_collapse, huge_page_size, mem);
+         }
+         else if (errno != EAGAIN) {
+            r.state = collapse_region::failed; // EAGAIN retries on the next pass
+         }
+      }
+      timespec ts = { c.interval_ms / 1000, (c.interval_ms % 1000) * 1000000L };
+      nanosleep(&ts, nullptr);
+   }
+   return nullptr;
+}
+
+// Bootstrap arena. The loader, dlsym and static constructors allocate before
+// anything else runs. Pool reservations come from here without a syscall
+// until the arena is used up, and the blocks are ordinary pool blocks, so
+// jp_free recycles them. Until this library's constructors have run, page
+// allocations (and the allocator's own tables) are carved from it too, and
+// the backend ignores frees of them.
+
+#if JP_ALLOC_BOOTSTRAP_SIZE > 0
+alignas(4096) char g_bootstrap[JP_ALLOC_BOOTSTRAP_SIZE];
+#else
+char *g_bootstrap = nullptr;
+#endif
+std::atomic<size_t> g_bootstrap_used;
+
+void *bootstrap_reserve(size_t size)
+{
+   size_t used = g_bootstrap_used.load(std::memory_order_relaxed);
+   do {
+      if (used + size > JP_ALLOC_BOOTSTRAP_SIZE) return nullptr;
+   } while (!g_bootstrap_used.compare_exchange_weak(used, used + size, std::memory_order_relaxed));
+   return g_bootstrap + used;
+}
+
+bool is_bootstrap(const void *mem)
+{
+   return static_cast<const char*>(mem) >= g_bootstrap && static_cast<const char*>(mem) < g_bootstrap + JP_ALLOC_BOOTSTRAP_SIZE;
+}
+
+bool g_initialized;
+
+__attribute__((constructor)) void bootstrap_done()
+{
+   g_initialized = true;
+}
+
+// page allocations of at least this size are marked MADV_MERGEABLE, SIZE_MAX
+// for none, so the check is one compare
+size_t g_mergeable_min = SIZE_MAX;
+
+// mark the pages of mem if it's a page allocation. Pool spans are left alone,
+// their pages are shared by blocks of unrelated owners
+void *mark_large(void *mem)
+{
+   if (mem == nullptr) return mem;
+   const jp::header *h = static_cast<jp::header*>(mem) - 1;
+   if (h->s.size < JP_ALLOC_POOL_COUNT) return mem;
+   // mapping starts at the page holding the header
+   const size_t ps_mask = jp::mmap_pages::page_size() - 1;
+   const size_t pre_padding = reinterpret_cast<size_t>(h) & ps_mask;
+   madvise(const_cast<char*>(reinterpret_cast<const char*>(h)) - pre_padding, (h->s.size + pre_padding + ps_mask) & ~ps_mask, MADV_MERGEABLE);
+   return mem;
+}
+
+// mmap backend that logs every call to the flight recorder. The backend is
+// only reached on slow paths, so this costs nothing for pooled blocks.
+struct recorded_pages : jp::mmap_pages
+{
+   static void *alloc(size_t size)
+   {
+      if (unlikely(!g_initialized)) {
+         if (void *mem = bootstrap_reserve(size)) return mem;
+      }
+      void *mem = jp::mmap_pages::alloc(size);
+      flight_record(mem ? jp_flight_map : jp_flight_map_failed, size, mem);
+      return mem;
+   }
+
+   static void *reserve(size_t size)
+   {
+      if (void *mem = bootstrap_reserve(size)) return mem;
+      void *mem = map_span(size);
+      if (mem) collapse_note(mem, size);
+      return mem;
+   }
+
+   static void *remap(void *mem, size_t old_size, size_t new_size, bool may_move = true)
+   {
+      if (unlikely(is_bootstrap(mem))) return nullptr;
+      void *p = jp::mmap_pages::remap(mem, old_size, new_size, may_move);
+      if (p) flight_record(jp_flight_remap, new_size, p);
+      return p;
+   }
+
+   static void free(void *mem, size_t size)
+   {
+      if (unlikely(is_bootstrap(mem))) return;
+      jp::mmap_pages::free(mem, size);
+      flight_record(jp_flight_unmap, size, mem);
+   }
+
+private:
+   static void *map_span(size_t size)
+   {
+      if (likely(!populate_wanted())) return alloc(size);
+      if (g_populate.madvise) {
+         void *mem = alloc(size);
+         if (mem) populate(mem, size);
+         return mem;
+      }
+      void *mem = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+      if (mem == MAP_FAILED) mem = nullptr;
+      flight_record(mem ? jp_flight_map : jp_flight_map_failed, size, mem);
+      return mem;
+   }
+};
+
+#ifdef DEBUG
+using global_stats = jp::counting_stats;
+#else
+using global_stats = jp::no_stats;
+#endif
+
+#if JP_ALLOC_PAGE_CACHE > 0
+using global_pages = jp::cached_pages<recorded_pages, 16, 16, JP_ALLOC_PAGE_CACHE / 2, JP_ALLOC_PAGE_CACHE>;
+#else
+using global_pages = recorded_pages;
+#endif
+
+using global_allocator = jp::pool_allocator<jp::pow2_classes<JP_ALLOC_POOL_COUNT>, jp::atomic_sync, global_pages, global_stats>;
+
+global_allocator g_alloc;
+
+// Locks a malloc can take are held across fork, as glibc malloc does, so the
+// child finds them all free. Registered before any handler that allocates in
+// the child, since child handlers run in registration order.
+void alloc_fork_prepare()
+{
+   g_alloc.lock_all();
+   pthread_mutex_lock(&g_collapse_mutex);
+   pthread_mutex_lock(&g_populate_mutex);
+#if JP_ALLOC_PAGE_CACHE > 0
+   global_pages::lock_all();
+#endif
+}
+
+void alloc_fork_release()
+{
+#if JP_ALLOC_PAGE_CACHE > 0
+   global_pages::unlock_all();
+#endif
+   pthread_mutex_unlock(&g_populate_mutex);
+   pthread_mutex_unlock(&g_collapse_mutex);
+   g_alloc.unlock_all();
+}
+
+int _alloc_fork = pthread_atfork(alloc_fork_prepare, alloc_fork_release, alloc_fork_release);
+
+// set once the process is tearing down, frees are dropped from then on
+std::atomic<bool> g_fast_exit;
+
+size_t os_page_size() 
+{ 
+   return global_allocator::pages::page_size(); 
+}
+
+// Profiler state. Thread local data uses the initial-exec model so touching it
+// never calls back into malloc.
+
+#define JP_TLS thread_local __attribute__((tls_model("initial-exec")))
+
+struct profile_thread
+{
+   unsigned depth;
+   jp_profile_counters total;
+   struct {
+      const char *name;
+      jp_profile_counters start;
+   } stack[JP_PROFILE_DEPTH];
+};
+
+JP_TLS profile_thread t_profile;
+
+struct profile_slot
+{
+   std::atomic<const char*> name;
+   std::atomic<unsigned long> calls;
+   std::atomic<unsigned long> allocs;
+   std::atomic<unsigned long> frees;
+   std::atomic<unsigned long> bytes;
+   std::atomic<unsigned long long> ns;
+};
+
+profile_slot g_profile[JP_PROFILE_SCOPES] = {};
+
+void profile_count(unsigned long allocs, unsigned long frees, size_t bytes, unsigned long long start)
+{
+   jp_profile_counters &t = t_profile.total;
+   t.allocs += allocs;
+   t.frees += frees;
+   t.bytes += bytes;
+   t.ns += now_ns() - start;
+}
+
+// find the slot for name, claiming a free one if needed. nullptr when all slots are taken
+profile_slot *profile_find(const char *name, bool claim)
+{
+   size_t hash = 5381;
+   for (const char *c = name; *c; ++c) hash = hash * 33 + *c;
+   for (size_t i = 0; i < JP_PROFILE_SCOPES; ++i) {
+      profile_slot *slot = g_profile + (hash + i) % JP_PROFILE_SCOPES;
+      const char *n = slot->name;
+      if (n == nullptr) {
+         if (!claim) return nullptr;
+         if (slot->name.compare_exchange_strong(n, name)) return slot;
+      }
+      if (n == name || strcmp(n, name) == 0) return slot;
+   }
+   return nullptr;
+}
+
+#ifdef DEBUG
+struct {
+      std::atomic<unsigned long> bad_free;
+      std::atomic<unsigned long> jp_alloc;
+      std::atomic<unsigned long> jp_alloc_aligned;
+      std::atomic<unsigned long> jp_realloc;
+      std::atomic<unsigned long> mallopt;
+} stat = {};
+#endif
+
+} // namespace
+
+void jp_profile_begin(const char *name)
+{
+	profile_thread &t = t_profile;
+	if (likely(t.depth < JP_PROFILE_DEPTH)) {
+		t.stack[t.depth].name = name;
+		t.stack[t.depth].start = t.total;
+	}
+	++t.depth;
+}
+
+void jp_profile_end()
+{
+	profile_thread &t = t_profile;
+	if (unlikely(t.depth == 0)) return;
+	if (likely(--t.depth < JP_PROFILE_DEPTH)) {
+		const jp_profile_counters &start = t.stack[t.depth].start;
+		profile_slot *slot = profile_find(t.stack[t.depth].name, true);
+		if (slot == nullptr) return;
+		slot->calls++;
+		slot->allocs += t.total.allocs - start.allocs;
+		slot->frees += t.total.frees - start.frees;
+		slot->bytes += t.total.bytes - start.bytes;
+		slot->ns += t.total.ns - start.ns;
+	}
+}
+
+bool jp_profile_get(const char *name, jp_profile_counters *counters)
+{
+	profile_slot *slot = profile_find(name, false);
+	if (slot == nullptr) return false;
+	*counters = { slot->calls, slot->allocs, slot->frees, slot->bytes, slot->ns };
+	return true;
+}
+
+void jp_profile_foreach(void (*fn)(const char *name, const jp_profile_counters &counters, void *arg), void *arg)
+{
+	for (profile_slot &slot : g_profile) {
+		const char *name = slot.name;
+		if (name == nullptr) continue;
+		jp_profile_counters c = { slot.calls, slot.allocs, slot.frees, slot.bytes, slot.ns };
+		fn(name, c, arg);
+	}
+}
+
+bool jp_heap_walk(void (*fn)(void *ptr, size_t size, size_t id, void *arg), void *arg)
+{
+	return g_alloc.walk([=](void *ptr, size_t size, size_t id) { fn(ptr, size, id, arg); });
+}
+
+bool jp_frag_get(size_t id, jp_frag_counters *counters)
+{
+#ifdef DEBUG
+	if (id > JP_ALLOC_POOL_COUNT) return false;
+	auto &ps = id < JP_ALLOC_POOL_COUNT ? g_alloc.pool_stats(id) : g_alloc.large_stats();
+	*counters = { ps.requested, ps.granted };
+	return true;
+#else
+	return false;
+#endif
+}
+
+namespace {
+
+// Self tuning controller
+
+struct {
+   jp_tune_config config;
+   pthread_t thread;
+   std::atomic<bool> running;
+   std::atomic<bool> stop;
+} g_tune;
+
+// Container resources
+
+struct {
+   std::atomic<unsigned> cpus;
+   std::atomic<size_t> memory;
+   std::atomic<bool> contained; // in a cgroup below the root, so limits may change
+} g_resources;
+
+// a container can be resized while the process runs
+constexpr unsigned resources_refresh_ms = 1000;
+
+// first line of a file, false if it can't be read
+bool read_line(const char *path, char *buf, size_t len)
+{
+   FILE *f = fopen(path, "r");
+   if (f == nullptr) return false;
+   bool ok = fgets(buf, len, f) != nullptr;
+   fclose(f);
+   return ok;
+}
+
+// cpus in a list like 0-3,8,10-11
+unsigned count_cpus(const char *list)
+{
+   unsigned count = 0;
+   while (*list >= '0' && *list <= '9') {
+      char *end;
+      unsigned long first = strtoul(list, &end, 10), last = first;
+      if (*end == '-') last = strtoul(end + 1, &end, 10);
+      if (last >= first) count += last - first + 1;
+      if (*end != ',') break;
+      list = end + 1;
+   }
+   return count;
+}
+
+const char *cgroup_root = "/sys/fs/cgroup";
+
+void resources_update()
+{
+   long online = sysconf(_SC_NPROCESSORS_ONLN);
+   unsigned cpus = online > 0 ? online : 1;
+   size_t memory = 0;
+   // the unified hierarchy entry is "0::/path"
+   char line[256], dir[320], path[352];
+   FILE *f = fopen("/proc/self/cgroup", "r");
+   bool found = false;
+   while (f && !found && fgets(line, sizeof(line), f)) found = strncmp(line, "0::", 3) == 0;
+   if (f) fclose(f);
+   if (found) {
+      line[strcspn(line, "\n")] = 0;
+      g_resources.contained = strcmp(line + 3, "/") != 0;
+      snprintf(dir, sizeof(dir), "%s%s", cgroup_root, strcmp(line + 3, "/") ? line + 3 : "");
+      snprintf(path, sizeof(path), "%s/cpuset.cpus.effective", dir);
+      if (read_line(path, line, sizeof(line)) && count_cpus(line)) cpus = std::min(cpus, count_cpus(line));
+      // limits set higher up apply too
+      for (;;) {
+         unsigned long long quota, period, bytes;
+         snprintf(path, sizeof(path), "%s/cpu.max", dir);
+         if (read_line(path, line, sizeof(line)) && sscanf(line, "%llu %llu", &quota, &period) == 2 && period)
+            cpus = std::min<unsigned>(cpus, std::max<unsigned long long>((quota + period - 1) / period, 1));
+         snprintf(path, sizeof(path), "%s/memory.max", dir);
+         if (read_line(path, line, sizeof(line)) && sscanf(line, "%llu", &bytes) == 1)
+            memory = memory ? std::min<size_t>(memory, bytes) : bytes;
+         char *slash = strrchr(dir, '/');
+         if (slash == nullptr || slash <= dir + strlen(cgroup_root)) break; // the root has no limits
+         *slash = 0;
+      }
+   }
+   g_resources.cpus.store(cpus, std::memory_order_relaxed);
+   g_resources.memory.store(memory, std::memory_order_relaxed);
+#if JP_ALLOC_PAGE_CACHE > 0
+   global_pages::limit(cpus, memory ? memory / 64 / cpus : JP_ALLOC_PAGE_CACHE);
+#endif
+}
+
+// Re-reads the limits of a contained process, so they stay current without
+// the tuner. The files are read here rather than from inside malloc, where
+// stdio could deadlock against a thread holding its locks.
+void *resources_thread(void *)
+{
+   for (;;) {
+      timespec ts = { resources_refresh_ms / 1000, (resources_refresh_ms % 1000) * 1000000L };
+      nanosleep(&ts, nullptr);
+      resources_update();
+   }
+   return nullptr;
+}
+
+void resources_start()
+{
+   pthread_t thread;
+   if (g_resources.contained && pthread_create(&thread, nullptr, resources_thread, nullptr) == 0) pthread_detach(thread);
+}
+
+size_t read_rss()
+{
+   FILE *f = fopen("/proc/self/statm", "r");
+   if (f == nullptr) return 0;
+   size_t size = 0, rss = 0;
+   if (fscanf(f, "%zu %zu", &size, &rss) != 2) rss = 0;
+   fclose(f);
+   return rss * os_page_size();
+}
+
+void tune_log(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+void tune_log(const char *fmt, ...)
+{
+   if (g_tune.config.log_fd < 0) return;
+   char buf[256];
+   va_list ap;
+   va_start(ap, fmt);
+   int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+   va_end(ap);
+   if (n > 0) write(g_tune.config.log_fd, buf, std::min<size_t>(n, sizeof(buf) - 1));
+}
+
+void *tune_thread(void *)
+{
+   const jp_tune_config &c = g_tune.config;
+   unsigned long last_refills = g_alloc.refills();
+   while (!g_tune.stop) {
+      timespec ts = { c.interval_ms / 1000, (c.interval_ms % 1000) * 1000000L };
+      nanosleep(&ts, nullptr);
+
+      resources_update();
+      const size_t max_rss = c.max_rss ? c.max_rss : g_resources.memory.load(std::memory_order_relaxed) / 10 * 9;
+      unsigned long refills = g_alloc.refills();
+      unsigned long rate = (refills - last_refills) * 1000 / c.interval_ms;
+      last_refills = refills;
+      size_t rss = read_rss();
+      size_t n = g_alloc.refill_blocks();
+      size_t next = n;
+      const char *why = nullptr;
+
+      // halving the batch doubles the refill rate, so shrink only well below
+      // target to avoid oscillating
+      if (max_rss && rss > max_rss && n > c.min_refill) next = std::max(n / 2, c.min_refill), why = "rss over limit";
+      else if (rate > c.target_refill_rate && n < c.max_refill) next = std::min(n * 2, c.max_refill), why = "refill rate high";
+      else if (rate < c.target_refill_rate / 4 && n > c.min_refill) next = std::max(n / 2, c.min_refill), why = "refill rate low";
+      if (max_rss && rss > max_rss && next > n) next = n, why = nullptr;
+
+      if (why) {
+         g_alloc.refill_blocks(next);
+         flight_record(jp_flight_tune, next, nullptr);
+         tune_log("jp_alloc tune: %s (%lu/s, rss %zu KB), refill %zu -> %zu blocks\n", why, rate, rss >> 10, n, next);
+      }
+   }
+   return nullptr;
+}
+
+} // namespace
+
+bool jp_tune_start(const jp_tune_config &config)
+{
+	bool expected = false;
+	if (!g_tune.running.compare_exchange_strong(expected, true)) return false;
+	g_tune.config = config;
+	if (g_tune.config.interval_ms == 0) g_tune.config.interval_ms = 1;
+	if (g_tune.config.min_refill == 0) g_tune.config.min_refill = 1;
+	if (g_tune.config.max_refill < g_tune.config.min_refill) g_tune.config.max_refill = g_tune.config.min_refill;
+	g_tune.stop = false;
+	if (pthread_create(&g_tune.thread, nullptr, tune_thread, nullptr) != 0) {
+		g_tune.running = false;
+		return false;
+	}
+	return true;
+}
+
+void jp_tune_stop()
+{
+	if (!g_tune.running) return;
+	g_tune.stop = true;
+	pthread_join(g_tune.thread, nullptr);
+	g_tune.running = false;
+}
+
+jp_resources jp_resources_get()
+{
+	jp_resources r;
+	r.cpus = g_resources.cpus.load(std::memory_order_relaxed);
+	r.memory = g_resources.memory.load(std::memory_order_relaxed);
+	return r;
+}
+
+static bool _resources = (resources_update(), resources_start(), pthread_atfork(nullptr, nullptr, resources_start), true);
+
+bool jp_populate_start(const jp_populate_config &config)
+{
+	pthread_mutex_lock(&g_populate_mutex);
+	if (g_populate.enabled) {
+		pthread_mutex_unlock(&g_populate_mutex);
+		return false;
+	}
+	g_populate.config = config;
+	// probe for MADV_POPULATE_WRITE, linux 5.14
+	const size_t ps = os_page_size();
+	void *probe = mmap(0, ps, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	g_populate.madvise = probe != MAP_FAILED && madvise(probe, ps, MADV_POPULATE_WRITE) == 0;
+	if (probe != MAP_FAILED) munmap(probe, ps);
+	if (!g_populate.madvise) g_populate.config.background = false;
+	if (g_populate.config.background) {
+		g_populate.stop = false;
+		g_populate.running = pthread_create(&g_populate.thread, nullptr, populate_thread, nullptr) == 0;
+		if (!g_populate.running) g_populate.config.background = false;
+	}
+	g_populate.enabled = true;
+	pthread_mutex_unlock(&g_populate_mutex);
+	return true;
+}
+
+void jp_populate_stop()
+{
+	pthread_mutex_lock(&g_populate_mutex);
+	g_populate.enabled = false;
+	bool running = g_populate.running;
+	g_populate.running = false;
+	g_populate.stop = true;
+	pthread_cond_signal(&g_populate_cond);
+	pthread_mutex_unlock(&g_populate_mutex);
+	if (running) pthread_join(g_populate.thread, nullptr);
+}
+
+static bool _populate = getenv("JP_ALLOC_POPULATE") && jp_populate_start(jp_populate_config());
+
+bool jp_collapse_start(const jp_collapse_config &config)
+{
+	bool expected = false;
+	if (!g_collapse.running.compare_exchange_strong(expected, true)) return false;
+	// probe for MADV_COLLAPSE, linux 6.1. EINVAL means unsupported, other
+	// errors (no huge page free right now) don't
+	void *probe = mmap(0, 2 * huge_page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	bool supported = probe != MAP_FAILED;
+	if (supported) {
+		char *aligned = reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(probe) + huge_page_size - 1) & ~(huge_page_size - 1));
+		*aligned = 1; // an empty range fails with EINVAL too
+		supported = madvise(aligned, huge_page_size, MADV_COLLAPSE) == 0 || errno != EINVAL;
+		munmap(probe, 2 * huge_page_size);
+	}
+	g_collapse.config = config;
+	if (g_collapse.config.interval_ms == 0) g_collapse.config.interval_ms = 1;
+	g_collapse.stop = false;
+	if (!supported || pthread_create(&g_collapse.thread, nullptr, collapse_thread, nullptr) != 0) {
+		g_collapse.running = false;
+		return false;
+	}
+	return true;
+}
+
+void jp_collapse_stop()
+{
+	if (!g_collapse.running) return;
+	g_collapse.stop = true;
+	pthread_join(g_collapse.thread, nullptr);
+	g_collapse.running = false;
+}
+
+unsigned long jp_collapse_count()
+{
+	return g_collapse.promoted.load(std::memory_order_relaxed);
+}
+
+static bool _collapse = getenv("JP_ALLOC_COLLAPSE") && jp_collapse_start(jp_collapse_config());
+
+jp_flight *jp_flight_recorder = nullptr;
+
+void jp_flight_dump(int fd)
+{
+	jp_flight *f = g_flight.load(std::memory_order_acquire);
+	if (f == nullptr) return;
+	static const char *names[] = { "?", "map", "unmap", "map failed", "tune", "remap", "alloc", "collapse" };
+	unsigned long end = f->next.load(std::memory_order_acquire);
+	unsigned long begin = end > f->capacity ? end - f->capacity : 0;
+	for (unsigned long n = begin; n < end; ++n) {
+		const jp_flight_event &e = f->events[n % f->capacity];
+		if (e.seq.load(std::memory_order_acquire) != n + 1) continue; // overwritten or in progress
+		char buf[128];
+		int len = snprintf(buf, sizeof(buf), "%llu.%09llu %u %s %zu %p\n", e.ns / 1000000000ULL, e.ns % 1000000000ULL,
+			e.tid, names[e.type < 8 ? e.type : 0], e.size, e.addr);
+		if (len > 0) write(fd, buf, std::min<size_t>(len, sizeof(buf) - 1));
+	}
+}
+
+static bool _tune = getenv("JP_ALLOC_TUNE") && jp_tune_start(jp_tune_config());
+
+namespace {
+
+// Heap timeline trace
+
+constexpr unsigned long trace_ring_events = 16384;
+
+struct {
+   jp_trace_config config;
+   FILE *out;
+   jp_flight *samples; // ring of sampled allocations
+   pthread_t thread;
+   std::atomic<bool> running;
+   std::atomic<bool> stop;
+   std::atomic<bool> sampling;
+} g_trace;
+
+JP_TLS unsigned t_trace_countdown;
+
+void trace_sample(size_t size, void *mem)
+{
+   if (t_trace_countdown-- > 0) return;
+   t_trace_countdown = g_trace.config.sample_rate - 1;
+   ring_record(g_trace.samples, jp_flight_sample, size, mem);
+}
+
+// write ring events from *last on, skipping any the writers have lapped
+void trace_drain(jp_flight *f, unsigned long *last)
+{
+   static const char *names[] = { "?", "map", "unmap", "map failed", "tune", "remap", "alloc", "collapse" };
+   const int pid = getpid();
+   unsigned long end = f->next.load(std::memory_order_acquire);
+   if (end - *last > f->capacity) *last = end - f->capacity;
+   for (; *last < end; ++*last) {
+      const jp_flight_event &e = f->events[*last % f->capacity];
+      if (e.seq.load(std::memory_order_acquire) != *last + 1) continue;
+      fprintf(g_trace.out, "{\"name\":\"%s\",\"cat\":\"jp_alloc\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":%d,\"tid\":%u,"
+         "\"args\":{\"size\":%zu,\"addr\":\"%p\"}},\n", names[e.type < 8 ? e.type : 0], e.ns / 1000.0, pid, e.tid, e.size, e.addr);
+   }
+}
+
+void trace_counters()
+{
+   const int pid = getpid();
+   const double ts = now_ns() / 1000.0;
+   fprintf(g_trace.out, "{\"name\":\"jp_alloc heap\",\"ph\":\"C\",\"ts\":%.3f,\"pid\":%d,\"args\":{\"pool mapped\":%llu,\"page allocations\":%zu}},\n",
+      ts, pid, g_alloc.refilled_bytes(), g_alloc.page_bytes());
+#ifdef DEBUG
+   for (size_t i = 0; i < JP_ALLOC_POOL_COUNT; ++i) {
+      auto &ps = g_alloc.pool_stats(i);
+      const size_t sz = global_allocator::size_class::size(i);
+      long live = ps.alloc_count, cached = ps.free_count;
+      if (live == 0 && cached == 0) continue;
+      fprintf(g_trace.out, "{\"name\":\"jp_alloc pool %zu\",\"ph\":\"C\",\"ts\":%.3f,\"pid\":%d,\"args\":{\"live\":%lu,\"cached\":%lu}},\n",
+         sz, ts, pid, live * sz, cached * sz);
+   }
+#endif
+}
+
+void *trace_thread(void *)
+{
+   unsigned long flight_last = 0, sample_last = 0;
+   const jp_trace_config &c = g_trace.config;
+   fprintf(g_trace.out, "[{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"jp_alloc\"}},\n", getpid());
+   while (!g_trace.stop) {
+      trace_counters();
+      if (jp_flight *f = g_flight.load(std::memory_order_acquire)) trace_drain(f, &flight_last);
+      if (g_trace.samples) trace_drain(g_trace.samples, &sample_last);
+      fflush(g_trace.out);
+      timespec ts = { c.interval_ms / 1000, (c.interval_ms % 1000) * 1000000L };
+      nanosleep(&ts, nullptr);
+   }
+   return nullptr;
+}
+
+} // namespace
+
+bool jp_trace_start(const jp_trace_config &config)
+{
+	bool expected = false;
+	if (config.path == nullptr || !g_trace.running.compare_exchange_strong(expected, true)) return false;
+	g_trace.config = config;
+	if (g_trace.config.interval_ms == 0) g_trace.config.interval_ms = 1;
+	g_trace.out = fopen(config.path, "w");
+	if (g_trace.out == nullptr) {
+		g_trace.running = false;
+		return false;
+	}
+	if (config.sample_rate && g_trace.samples == nullptr) {
+		const size_t bytes = sizeof(jp_flight) + (trace_ring_events - 1) * sizeof(jp_flight_event);
+		void *mem = mmap(0, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (mem != MAP_FAILED) {
+			g_trace.samples = static_cast<jp_flight*>(mem);
+			memcpy(g_trace.samples->magic, "JPSAMPLE", 8);
+			g_trace.samples->capacity = trace_ring_events;
+		}
+	}
+	g_trace.stop = false;
+	if (pthread_create(&g_trace.thread, nullptr, trace_thread, nullptr) != 0) {
+		fclose(g_trace.out);
+		g_trace.running = false;
+		return false;
+	}
+	g_trace.sampling = config.sample_rate && g_trace.samples;
+	return true;
+}
+
+void jp_trace_stop()
+{
+	if (!g_trace.running) return;
+	g_trace.sampling = false;
+	g_trace.stop = true;
+	pthread_join(g_trace.thread, nullptr);
+	fputs("{}]\n", g_trace.out);
+	fclose(g_trace.out);
+	g_trace.running = false;
+}
+
+static bool _trace = getenv("JP_ALLOC_TRACE") && [] {
+	jp_trace_config config;
+	config.path = getenv("JP_ALLOC_TRACE");
+	return jp_trace_start(config) && std::atexit(jp_trace_stop) == 0;
+}();
+
+#ifdef DEBUG
+
+void print_frag(std::ostream &out, const char *name, const jp_frag_counters &c)
+{
+	double waste = c.granted ? 100.0 * (c.granted - c.requested) / c.granted : 0;
+	out << name << ": " << c.requested << ' ' << c.granted << ' ' << waste << '%' << std::endl;
+}
+
+void jpalloc_print_stats()
+{
+	std::ofstream out(std::string("/tmp/jpalloc.log-") + std::to_string(getpid()));
+	out << "-------" << std::endl;
+	out << "page size.......: " << os_page_size() << std::endl;
+	out << "pool count......: " << JP_ALLOC_POOL_COUNT << std::endl;
+	out << "bad free........: " << stat.bad_free << std::endl;
+   	out << "jp_alloc........: " << stat.jp_alloc << std::endl;
+   	out << "jp_alloc_aligned: " << stat.jp_alloc_aligned << std::endl;
+   	out << "jp_realloc......: " << stat.jp_realloc << std::endl;
+   	out << "mallopt.........: " << stat.mallopt << std::endl;
+	out << "bootstrap.......: " << std::min<size_t>(g_bootstrap_used, JP_ALLOC_BOOTSTRAP_SIZE) << '/' << JP_ALLOC_BOOTSTRAP_SIZE << std::endl;
+	out << "huge pages......: " << jp_collapse_count() << std::endl;
+#if JP_ALLOC_PAGE_CACHE > 0
+	out << "page cache......: " << global_pages::cached_bytes() << std::endl;
+#endif
+	for (size_t i = 0; i < JP_ALLOC_POOL_COUNT; ++i) {
+		auto &ps = g_alloc.pool_stats(i);
+		out << i << ": " << ps.alloc_calls << ' ' << ps.alloc_count << ' ' << ps.free_count << std::endl;
+	}
+	// internal fragmentation per class and per size band: requested granted waste
+	const size_t bands[] = { 128, 1024, 8192, 65536 };
+	const char *band_names[] = { "band <=128", "band <=1K", "band <=8K", "band <=64K", "band >64K" };
+	jp_frag_counters band[5] = {};
+	for (size_t i = 0; i <= JP_ALLOC_POOL_COUNT; ++i) {
+		jp_frag_counters c;
+		jp_frag_get(i, &c);
+		if (c.granted == 0) continue;
+		std::string name = i < JP_ALLOC_POOL_COUNT ? "frag " + std::to_string(i) : std::string("frag pages");
+		print_frag(out, name.c_str(), c);
+		size_t b = 0;
+		while (b < 4 && (i == JP_ALLOC_POOL_COUNT || global_allocator::size_class::size(i) > bands[b])) ++b;
+		band[b].requested += c.requested;
+		band[b].granted += c.granted;
+	}
+	for (size_t b = 0; b < 5; ++b) {
+		if (band[b].granted) print_frag(out, band_names[b], band[b]);
+	}
+	jp_profile_foreach([](const char *name, const jp_profile_counters &c, void *arg) {
+		*static_cast<std::ofstream*>(arg) << "scope " << name << ": " << c.calls << ' ' << c.allocs << ' ' << c.frees << ' ' << c.bytes << ' ' << c.ns << "ns" << std::endl;
+	}, &out);
+	out << "-------" << std::endl;
+}
+#endif
+
+size_t jp_good_size(size_t size)
+{
+	return global_allocator::good_size(size);
+}
+	
+void jp_fast_exit()
+{
+	g_fast_exit.store(true, std::memory_order_relaxed);
+}
+
+#if JP_ALLOC_EXIT_HOOKS
+
+namespace {
+
+// Exit processing starts with a call to exit or a return from main. An
+// atexit handler would run after the static destructors registered later,
+// so both are hooked instead: exit is interposed, and main is wrapped on
+// its way in through __libc_start_main. Unarmed, the hooks cost a flag test.
+
+std::atomic<bool> g_fast_exit_armed;
+
+using main_fn = int (*)(int, char **, char **);
+main_fn g_main;
+
+int fast_exit_main(int argc, char **argv, char **envp)
+{
+   const int status = g_main(argc, argv, envp);
+   if (g_fast_exit_armed.load(std::memory_order_relaxed)) jp_fast_exit();
+   return status;
+}
+
+// the libc function a hook forwards to, aborting with a message if it's missing
+void *next_symbol(const char *name)
+{
+   void *sym = dlsym(RTLD_NEXT, name);
+   if (sym == nullptr) {
+      char buf[128];
+      int len = snprintf(buf, sizeof(buf), "jp_alloc: %s not found after the library, build with -DJP_ALLOC_EXIT_HOOKS=0\n", name);
+      if (len > 0) write(2, buf, std::min<size_t>(len, sizeof(buf) - 1));
+      abort();
+   }
+   return sym;
+}
+
+} // namespace
+
+extern "C" void exit(int status)
+{
+	if (g_fast_exit_armed.load(std::memory_order_relaxed)) jp_fast_exit();
+	static auto next = reinterpret_cast<void (*)(int)>(next_symbol("exit"));
+	next(status);
+	__builtin_unreachable();
+}
+
+extern "C" int __libc_start_main(main_fn main, int argc, char **argv, void (*init)(), void (*fini)(), void (*rtld_fini)(), void *stack_end)
+{
+	using start_fn = int (*)(main_fn, int, char **, void (*)(), void (*)(), void (*)(), void *);
+	auto next = reinterpret_cast<start_fn>(next_symbol("__libc_start_main"));
+	g_main = main;
+	return next(fast_exit_main, argc, argv, init, fini, rtld_fini, stack_end);
+}
+
+bool jp_fast_exit_on_exit()
+{
+	g_fast_exit_armed.store(true, std::memory_order_relaxed);
+	return true;
+}
+
+#else
+
+bool jp_fast_exit_on_exit()
+{
+	return false;
+}
 
-#ifdef DEBUG
-#include <iostream>
-#include <fstream>
 #endif
 
-#ifdef __GNUC__
-#define likely(x)       __builtin_expect(!!(x), 1)
-#define unlikely(x)     __builtin_expect(!!(x), 0)
+static bool _fe = getenv("JP_ALLOC_FAST_EXIT") && jp_fast_exit_on_exit();
+
+void jp_free(void *mem)
+{
+	if (unlikely(mem == nullptr)) return;
+	if (unlikely(g_fast_exit.load(std::memory_order_relaxed))) return;
+	unsigned long long start = unlikely(t_profile.depth) ? now_ns() : 0;
+#ifdef DEBUG
+	if (!g_alloc.free(mem)) ++stat.bad_free;
 #else
-#define likely(x)       (x)
-#define unlikely(x)     (x)
+	g_alloc.free(mem);
 #endif
-	
-#ifndef JP_ALLOC_POOL_COUNT
-#define JP_ALLOC_POOL_COUNT 16
+	if (unlikely(start)) profile_count(0, 1, 0, start);
+}
+
+void jp_free_batch(void **mem, size_t count)
+{
+	if (unlikely(g_fast_exit.load(std::memory_order_relaxed))) return;
+	unsigned long long start = unlikely(t_profile.depth) ? now_ns() : 0;
+	size_t bad = g_alloc.free_batch(mem, count);
+#ifdef DEBUG
+	stat.bad_free += bad;
+#else
+	(void)bad;
 #endif
+	if (unlikely(start)) profile_count(0, count, 0, start);
+}
 
 namespace {
 
-size_t os_page_size() 
-{ 
-   return sysconf(_SC_PAGESIZE); 
+// Epoch based reclamation for jp_retire.
+// Every thread that reads or retires owns an epoch_record. A reader publishes
+// the global epoch it entered in, the epoch advances once every active reader
+// has seen the current one, and a block retired in epoch e is safe to free
+// once the global epoch reaches e + 2.
+
+constexpr unsigned long retire_batch = 64; // retires between attempts to advance
+constexpr unsigned collect_exits = 16; // read exits between attempts while blocks wait
+
+struct epoch_record
+{
+   std::atomic<unsigned long> epoch; // epoch entered in, 0 when not reading
+   std::atomic<bool> in_use;
+   epoch_record *next;
+};
+
+std::atomic<unsigned long> g_epoch = {1};
+std::atomic<epoch_record*> g_epoch_records;
+
+// retired blocks, linked through their headers
+struct retire_bag
+{
+   header *head;
+   header *tail;
+   unsigned long epoch;
+};
+
+struct retire_thread
+{
+   epoch_record *rec;
+   unsigned nest;
+   unsigned long retired;
+   unsigned exits;
+   retire_bag bags[3]; // indexed by epoch % 3
+};
+
+JP_TLS retire_thread t_retire;
+
+// bags left behind by exited threads. Written under mutex, read without it
+// to skip the lock when there is nothing to take
+struct {
+   jp::spin_lock mutex;
+   std::atomic<header*> head;
+   std::atomic<unsigned long> epoch;
+} g_orphans;
+
+pthread_key_t g_retire_key;
+pthread_once_t g_retire_once = PTHREAD_ONCE_INIT;
+
+void retire_thread_exit(void *arg)
+{
+   retire_thread &t = *static_cast<retire_thread*>(arg);
+   g_orphans.mutex.lock();
+   for (retire_bag &b : t.bags) {
+      if (b.head == nullptr) continue;
+      b.tail->s.next = g_orphans.head.load(std::memory_order_relaxed);
+      g_orphans.head.store(b.head, std::memory_order_relaxed);
+      g_orphans.epoch.store(std::max(g_orphans.epoch.load(std::memory_order_relaxed), b.epoch), std::memory_order_relaxed);
+      b.head = nullptr;
+   }
+   g_orphans.mutex.unlock();
+   t.rec->epoch.store(0);
+   t.rec->in_use.store(false, std::memory_order_release);
+   t.rec = nullptr;
+   t.nest = 0;
 }
 
-void *os_alloc_pages(size_t size)
+epoch_record *epoch_acquire()
 {
-	void *mem = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-        if (mem == MAP_FAILED) mem = nullptr;
-        return mem;
+   for (epoch_record *r = g_epoch_records; r != nullptr; r = r->next) {
+      bool expected = false;
+      if (!r->in_use && r->in_use.compare_exchange_strong(expected, true)) return r;
+   }
+   void *mem = g_alloc.alloc(sizeof(epoch_record));
+   if (mem == nullptr) abort(); // no way to report failure to a reader
+   epoch_record *r = new (mem) epoch_record();
+   r->in_use = true;
+   r->next = g_epoch_records;
+   while (!g_epoch_records.compare_exchange_weak(r->next, r));
+   return r;
 }
 
-void os_free_pages(void *mem, size_t size)
+retire_thread &retire_self()
 {
-   munmap(mem, size);
+   retire_thread &t = t_retire;
+   if (unlikely(t.rec == nullptr)) {
+      pthread_once(&g_retire_once, [] { pthread_key_create(&g_retire_key, retire_thread_exit); });
+      t.rec = epoch_acquire();
+      pthread_setspecific(g_retire_key, &t);
+   }
+   return t;
 }
 
-union header
+void epoch_try_advance()
 {
-	struct {
-		size_t size; // In principle, only size needs to be outside user area
-		header *next;
-	} s;
-        std::max_align_t _align;
-};
-                                                    
-struct pool
+   unsigned long e = g_epoch.load();
+   for (epoch_record *r = g_epoch_records; r != nullptr; r = r->next) {
+      unsigned long re = r->epoch.load();
+      if (re != 0 && re != e) return; // a reader is still in an older epoch
+   }
+   g_epoch.compare_exchange_strong(e, e + 1);
+}
+
+void epoch_collect(retire_thread &t)
+{
+   const unsigned long e = g_epoch.load();
+   for (retire_bag &b : t.bags) {
+      if (b.head != nullptr && b.epoch + 2 <= e) {
+         g_alloc.free_chain(b.head);
+         b.head = nullptr;
+      }
+   }
+   if (g_orphans.head.load(std::memory_order_relaxed) != nullptr && g_orphans.epoch.load(std::memory_order_relaxed) + 2 <= e) {
+      g_orphans.mutex.lock();
+      header *h = g_orphans.epoch.load(std::memory_order_relaxed) + 2 <= e ? g_orphans.head.load(std::memory_order_relaxed) : nullptr;
+      if (h) g_orphans.head.store(nullptr, std::memory_order_relaxed);
+      g_orphans.mutex.unlock();
+      if (h) g_alloc.free_chain(h);
+   }
+}
+
+// blocks waiting in this thread's bags or left by exited threads
+bool retire_pending(const retire_thread &t)
+{
+   return t.bags[0].head || t.bags[1].head || t.bags[2].head || g_orphans.head.load(std::memory_order_relaxed);
+}
+
+} // namespace
+
+void jp_read_enter()
+{
+	retire_thread &t = retire_self();
+	if (t.nest++ == 0) {
+		t.rec->epoch.store(g_epoch.load(std::memory_order_relaxed), std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+	}
+}
+
+void jp_read_exit()
 {
+	retire_thread &t = t_retire;
+	if (t.nest > 0 && --t.nest == 0) {
+		t.rec->epoch.store(0, std::memory_order_release);
+		// a thread that retires rarely would otherwise hold its blocks until
+		// retire_batch more retires or its exit
+		if (unlikely(retire_pending(t)) && ++t.exits >= collect_exits) {
+			t.exits = 0;
+			epoch_try_advance();
+			epoch_collect(t);
+		}
+	}
+}
 
+void jp_retire(void *mem)
+{
+	if (unlikely(mem == nullptr)) return;
+	if (unlikely(g_fast_exit.load(std::memory_order_relaxed))) return;
+	if (unlikely(!global_allocator::owns(mem))) {
 #ifdef DEBUG
-   struct
-   {
-      std::atomic<unsigned long> alloc_calls;
-      std::atomic<unsigned long> alloc_count;
-      std::atomic<unsigned long> free_count;
-   } stat = {};
+		++stat.bad_free;
 #endif
+		return;
+	}
+	header *h = static_cast<header*>(mem) - 1;
+	retire_thread &t = retire_self();
+	const unsigned long e = g_epoch.load();
+	retire_bag &b = t.bags[e % 3];
+	if (b.head != nullptr && b.epoch != e) {
+		// left from epoch e - 3 or earlier, safe by now
+		g_alloc.free_chain(b.head);
+		b.head = nullptr;
+	}
+	if (b.head == nullptr) b.tail = h;
+	b.epoch = e;
+	h->s.next = b.head;
+	b.head = h;
+	if (++t.retired >= retire_batch) {
+		t.retired = 0;
+		epoch_try_advance();
+		epoch_collect(t);
+	}
+}
 
-   std::atomic<header*> head;
-};
+namespace {
+
+// Burst hints, carved by one thread started on first use
 
-#ifdef DEBUG
 struct {
-      std::atomic<unsigned long> bad_free;
-      std::atomic<unsigned long> jp_alloc;
-      std::atomic<unsigned long> jp_alloc_aligned;
-      std::atomic<unsigned long> jp_realloc;
-      std::atomic<unsigned long> mallopt;
-} stat = {};
-#endif
+   struct {
+      size_t id;
+      size_t count;
+   } queue[64];
+   size_t head, tail;
+   bool running;
+} g_expect;
 
-pool g_pools[JP_ALLOC_POOL_COUNT] = {};
-pool *g_pools_last = g_pools + JP_ALLOC_POOL_COUNT - 1;
+pthread_mutex_t g_expect_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t g_expect_cond = PTHREAD_COND_INITIALIZER;
 
-void pool_put(header *h, pool *p)
+void *expect_thread(void *)
 {
-#ifdef DEBUG
-        p->stat.alloc_count--;
-	p->stat.free_count++;
-#endif
-	header *expected = p->head;
-	do h->s.next = expected;
-	while (!p->head.compare_exchange_weak(expected, h));
+   pthread_mutex_lock(&g_expect_mutex);
+   for (;;) {
+      if (g_expect.head == g_expect.tail) {
+         pthread_cond_wait(&g_expect_cond, &g_expect_mutex);
+         continue;
+      }
+      auto hint = g_expect.queue[g_expect.head];
+      g_expect.head = (g_expect.head + 1) % 64;
+      pthread_mutex_unlock(&g_expect_mutex);
+      g_alloc.prefill(hint.id, hint.count);
+      pthread_mutex_lock(&g_expect_mutex);
+   }
+   return nullptr;
 }
 
-void *pool_get(pool *p) 
+// Threads don't survive fork, but the flags saying they run do. The child
+// clears them so the burst hint thread starts again on the next jp_expect
+// and the populate thread right away. Their locks may have been held by a
+// thread of the parent, so the child gets fresh ones.
+void threads_fork_child()
 {
-	header *expected = p->head;
-	if (likely(expected != nullptr)) {
-                // Normal case. Grap memory from pool
-		header *next;
-		do next = expected->s.next;
-		while (!p->head.compare_exchange_weak(expected, next) && expected != nullptr);
-#ifdef DEBUG
-                if (expected != nullptr) p->stat.alloc_count++, p->stat.free_count--;
-#endif
+   pthread_mutex_init(&g_expect_mutex, nullptr);
+   pthread_cond_init(&g_expect_cond, nullptr);
+   g_expect.running = false;
+   pthread_mutex_init(&g_populate_mutex, nullptr);
+   pthread_cond_init(&g_populate_cond, nullptr);
+   if (g_populate.running) {
+      g_populate.running = pthread_create(&g_populate.thread, nullptr, populate_thread, nullptr) == 0;
+      if (!g_populate.running) g_populate.config.background = false;
+   }
+}
+
+int _threads_fork = pthread_atfork(nullptr, nullptr, threads_fork_child);
+
+} // namespace
+
+bool jp_expect(size_t size, size_t count)
+{
+	const size_t id = global_allocator::size_class::id(size + sizeof(jp::header));
+	if (id >= global_allocator::size_class::count || count == 0) return false;
+	pthread_mutex_lock(&g_expect_mutex);
+	if (!g_expect.running) {
+		pthread_t thread;
+		g_expect.running = pthread_create(&thread, nullptr, expect_thread, nullptr) == 0;
+		if (g_expect.running) pthread_detach(thread);
 	}
-	if (unlikely(expected == nullptr)) {
-                // Current pool was empty
-		if (p == g_pools_last) {
-                        // Last pool. Ask OS for memory
-			constexpr size_t sz = 1U << (JP_ALLOC_POOL_COUNT - 1);
-			expected = static_cast<header*>(os_alloc_pages(sz));
-			if (likely(expected != nullptr)) expected->s.size = JP_ALLOC_POOL_COUNT - 1;
-#ifdef DEBUG
-                        if (expected != nullptr) p->stat.alloc_count++;
-#endif
-		}
-		else {
-                        // Get from next pool and split
-			char *mem = static_cast<char*>(pool_get(p + 1));
-                        if (mem != nullptr) {
-                           expected = reinterpret_cast<header*>(mem);
-                           size_t sz = expected->s.size - 1;
-                           header *spare = reinterpret_cast<header*>(mem + (1U << sz));
-                           expected->s.size = sz;
-                           spare->s.size = sz;
-#ifdef DEBUG
-                           // one p+1 allocation becomes two allocated in p
-                           (p+1)->stat.alloc_count--;
-                           p->stat.alloc_count += 2;
-#endif
-                           pool_put(spare, p);
-                        }
-		}
+	const size_t next = (g_expect.tail + 1) % 64;
+	const bool queued = g_expect.running && next != g_expect.head;
+	if (queued) {
+		g_expect.queue[g_expect.tail] = { id, count };
+		g_expect.tail = next;
+		pthread_cond_signal(&g_expect_cond);
 	}
-#ifdef DEBUG
-        p->stat.alloc_calls++;
-        if (expected) expected->s.next = expected;
-#endif
-	return expected;
+	pthread_mutex_unlock(&g_expect_mutex);
+	return queued;
 }
 
-size_t pool_id(size_t size)
+namespace {
+
+// Movable handle allocations.
+// Handle objects are bump allocated in their own aligned chunks, each behind
+// a header naming its handle. A handle indexes a table entry holding the
+// object's address and a pin count. Chunks are unmapped only by the
+// compactor, which moves an unpinned object by setting the entry's moving
+// bit (holding off pins), copying it into the newest chunk and swinging the
+// address. Entry tables are never unmapped, so pins need no lock.
+
+constexpr size_t handle_chunk_size = 256 * 1024;
+constexpr size_t handle_max_movable = 32 * 1024;
+constexpr size_t handle_table_pages = 1024;
+constexpr size_t handle_page_entries = 4096;
+constexpr uint32_t handle_moving = 1u << 31;
+
+struct handle_entry
 {
-   --size;
-   size_t id = 0;
-   while (size) ++id, size >>= 1;
-   return id;
-}
+   std::atomic<void*> ptr;
+   std::atomic<uint32_t> state; // pin count, plus handle_moving while moved
+   uint32_t next_free;
+   bool fixed; // a plain allocation
+};
+
+struct handle_object
+{
+   uint32_t handle; // 0 once freed or moved away
+   uint32_t size; // bytes with this header, a multiple of 16
+   char pad[8];
+};
+
+struct handle_chunk
+{
+   handle_chunk *next;
+   size_t used; // bump offset
+   size_t live; // bytes of live objects
+   char pad[40];
+};
 
-bool is_pow2(size_t n)
+struct {
+   std::atomic<handle_entry*> pages[handle_table_pages];
+   uint32_t entries;
+   uint32_t free_head;
+   handle_chunk *chunks; // newest first, allocations go to the first
+   jp_compact_config config;
+   pthread_t thread;
+   std::atomic<bool> running;
+   std::atomic<bool> stop;
+} g_handles;
+
+pthread_mutex_t g_handles_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t g_compact_mutex = PTHREAD_MUTEX_INITIALIZER; // one compaction pass at a time
+
+handle_entry &handle_get(jp_handle h)
 {
-   // test if n is power of 2. true for 0 also
-   return (n & (n - 1)) == 0;
+   return g_handles.pages[(h - 1) / handle_page_entries].load(std::memory_order_acquire)[(h - 1) % handle_page_entries];
 }
 
-void *alloc_pages_aligned(size_t alignment, size_t size)
+// a free table entry, 0 if the table is full. g_handles_mutex held
+jp_handle handle_new()
 {
-   if (unlikely(!is_pow2(alignment))) return nullptr;
-   const size_t ps = os_page_size();
-   size_t pre_padding = 0; // space needed before header to align final pointer
-   size_t align_size = 0; // extra space needed to ensure we can get correct alignment in span
-   if (alignment > ps) {
-      pre_padding = ps - sizeof(header);
-      align_size = alignment - ps; // need alignment pages - 1 to ensure alignment
+   if (jp_handle h = g_handles.free_head) {
+      g_handles.free_head = handle_get(h).next_free;
+      return h;
    }
-   else if (alignment > sizeof(header)) {
-      pre_padding = alignment - sizeof(header);
+   const size_t page = g_handles.entries / handle_page_entries;
+   if (page == handle_table_pages) return 0;
+   if (g_handles.pages[page].load(std::memory_order_relaxed) == nullptr) {
+      void *mem = recorded_pages::alloc(handle_page_entries * sizeof(handle_entry));
+      if (mem == nullptr) return 0;
+      g_handles.pages[page].store(static_cast<handle_entry*>(mem), std::memory_order_release);
    }
-   else {
-      alignment = sizeof(header); // minimum alignment.
+   return ++g_handles.entries;
+}
+
+handle_chunk *chunk_of(void *mem)
+{
+   return reinterpret_cast<handle_chunk*>(reinterpret_cast<uintptr_t>(mem) & ~(handle_chunk_size - 1));
+}
+
+// bump allocate bytes in the newest chunk, mapping one when full. g_handles_mutex held
+handle_object *chunk_alloc(size_t bytes)
+{
+   handle_chunk *c = g_handles.chunks;
+   if (c == nullptr || c->used + bytes > handle_chunk_size) {
+      // over map and trim to get an aligned chunk
+      char *mem = static_cast<char*>(recorded_pages::alloc(2 * handle_chunk_size));
+      if (mem == nullptr) return nullptr;
+      char *aligned = reinterpret_cast<char*>(chunk_of(mem + handle_chunk_size - 1));
+      if (aligned > mem) recorded_pages::free(mem, aligned - mem);
+      if (mem + handle_chunk_size > aligned) recorded_pages::free(aligned + handle_chunk_size, mem + handle_chunk_size - aligned);
+      c = reinterpret_cast<handle_chunk*>(aligned);
+      c->next = g_handles.chunks;
+      c->used = sizeof(handle_chunk);
+      c->live = 0;
+      g_handles.chunks = c;
    }
-   size_t span_size = pre_padding + size + align_size;
-   size_t span_size_rounded = (span_size + ps - 1) & ~(ps - 1); // round to whole pages
-   char *span = static_cast<char*>(os_alloc_pages(span_size_rounded));
-   if (unlikely(span == nullptr)) return nullptr;
-   char *hdr = span + pre_padding;
-   size_t offset = (alignment - reinterpret_cast<size_t>(hdr + sizeof(header)) & (alignment - 1)) & (alignment - 1);
-   hdr += offset;
-   if (align_size > 0) {
-      // if we have align pages, offset will be in whole pages (alignment > page size)
-      // free pre and post align pages
-      size_t pre_size = offset;
-      size_t post_size = align_size - pre_size;
-      if (pre_size > 0) os_free_pages(span, pre_size);
-      if (post_size > 0) os_free_pages(span + span_size_rounded - post_size, post_size);
+   handle_object *o = reinterpret_cast<handle_object*>(reinterpret_cast<char*>(c) + c->used);
+   c->used += bytes;
+   c->live += bytes;
+   return o;
+}
+
+// evacuate chunks below max_density percent live and unmap the empty ones.
+// A pass running elsewhere is waited for, then this one runs
+size_t handle_compact(unsigned max_density)
+{
+   size_t released = 0;
+   pthread_mutex_lock(&g_compact_mutex);
+   pthread_mutex_lock(&g_handles_mutex);
+   // the newest chunk takes the moved objects, the rest is only unlinked here
+   handle_chunk **link = g_handles.chunks ? &g_handles.chunks->next : nullptr;
+   while (link && *link) {
+      handle_chunk *c = *link;
+      if (c->live * 100 < handle_chunk_size * max_density) {
+         char *end = reinterpret_cast<char*>(c) + c->used;
+         for (char *p = reinterpret_cast<char*>(c + 1); p < end && c->live; p += reinterpret_cast<handle_object*>(p)->size) {
+            handle_object *o = reinterpret_cast<handle_object*>(p);
+            if (o->handle == 0) continue;
+            handle_entry &e = handle_get(o->handle);
+            uint32_t unpinned = 0;
+            if (!e.state.compare_exchange_strong(unpinned, handle_moving, std::memory_order_acquire)) continue;
+            handle_object *to = chunk_alloc(o->size);
+            if (to == nullptr) {
+               e.state.store(0, std::memory_order_release);
+               break;
+            }
+            memcpy(to, o, o->size);
+            e.ptr.store(to + 1, std::memory_order_relaxed);
+            e.state.store(0, std::memory_order_release);
+            o->handle = 0;
+            c->live -= o->size;
+         }
+      }
+      if (c->live == 0) {
+         *link = c->next;
+         recorded_pages::free(c, handle_chunk_size);
+         released += handle_chunk_size;
+      }
+      else {
+         link = &c->next;
+      }
+      // let allocations and frees in between chunks. Only a compaction pass
+      // unlinks chunks and g_compact_mutex keeps it the only one, so link
+      // stays valid
+      pthread_mutex_unlock(&g_handles_mutex);
+      pthread_mutex_lock(&g_handles_mutex);
    }
-   return hdr;
+   pthread_mutex_unlock(&g_handles_mutex);
+   pthread_mutex_unlock(&g_compact_mutex);
+   return released;
 }
 
+void *compact_thread(void *)
+{
+   const jp_compact_config &c = g_handles.config;
+   while (!g_handles.stop) {
+      timespec ts = { c.interval_ms / 1000, (c.interval_ms % 1000) * 1000000L };
+      nanosleep(&ts, nullptr);
+      handle_compact(c.max_density);
+   }
+   return nullptr;
+}
 
 } // namespace
 
-#ifdef DEBUG
-
-void jpalloc_print_stats()
+jp_handle jp_halloc(size_t size)
 {
-	std::ofstream out(std::string("/tmp/jpalloc.log-") + std::to_string(getpid()));
-	out << "-------" << std::endl;
-	out << "page size.......: " << os_page_size() << std::endl;
-	out << "pool count......: " << JP_ALLOC_POOL_COUNT << std::endl;
-	out << "bad free........: " << stat.bad_free << std::endl;
-   	out << "jp_alloc........: " << stat.jp_alloc << std::endl;
-   	out << "jp_alloc_aligned: " << stat.jp_alloc_aligned << std::endl;
-   	out << "jp_realloc......: " << stat.jp_realloc << std::endl;
-   	out << "mallopt.........: " << stat.mallopt << std::endl;
-	for (size_t i = 0; i < JP_ALLOC_POOL_COUNT; ++i) {
-		out << i << ": " << g_pools[i].stat.alloc_calls << ' ' << g_pools[i].stat.alloc_count << ' ' << g_pools[i].stat.free_count << std::endl;
+	void *fixed = nullptr;
+	if (size > handle_max_movable) {
+		fixed = jp_alloc(size);
+		if (fixed == nullptr) return 0;
 	}
-	out << "-------" << std::endl;
+	pthread_mutex_lock(&g_handles_mutex);
+	jp_handle h = handle_new();
+	void *mem = fixed;
+	if (h && fixed == nullptr) {
+		const uint32_t bytes = (sizeof(handle_object) + std::max<size_t>(size, 1) + 15) & ~15;
+		if (handle_object *o = chunk_alloc(bytes)) {
+			o->handle = h;
+			o->size = bytes;
+			mem = o + 1;
+		}
+	}
+	if (h && mem == nullptr) {
+		handle_get(h).next_free = g_handles.free_head;
+		g_handles.free_head = h;
+		h = 0;
+	}
+	if (h) {
+		handle_entry &e = handle_get(h);
+		e.fixed = fixed != nullptr;
+		e.state.store(0, std::memory_order_relaxed);
+		e.ptr.store(mem, std::memory_order_release);
+	}
+	pthread_mutex_unlock(&g_handles_mutex);
+	if (h == 0 && fixed) jp_free(fixed);
+	return h;
 }
-#endif
 
-size_t jp_good_size(size_t size)
+void jp_hfree(jp_handle h)
 {
-	size_t pid = pool_id(size);
-	if (likely(pid < JP_ALLOC_POOL_COUNT)) {
-		size = (1U << pid);
-        }
-        else {
-                size_t ps_mask = os_page_size() - 1;
-                size = (size + ps_mask) & ~ps_mask; // round to whole pages
-        }
-        return size - sizeof(header);
+	if (h == 0) return;
+	pthread_mutex_lock(&g_handles_mutex);
+	handle_entry &e = handle_get(h);
+	void *mem = e.ptr.load(std::memory_order_relaxed);
+	const bool fixed = e.fixed;
+	if (!fixed) {
+		// an emptied chunk is unmapped by the next compaction
+		handle_object *o = static_cast<handle_object*>(mem) - 1;
+		chunk_of(o)->live -= o->size;
+		o->handle = 0;
+	}
+	e.ptr.store(nullptr, std::memory_order_relaxed);
+	e.next_free = g_handles.free_head;
+	g_handles.free_head = h;
+	pthread_mutex_unlock(&g_handles_mutex);
+	if (fixed) jp_free(mem);
 }
-	
-void jp_free(void *mem)
+
+void *jp_hpin(jp_handle h)
 {
-	if (unlikely(mem == nullptr)) return;
-		
-	header *h = static_cast<header*>(mem) - 1;
-#ifdef DEBUG
-	if (h->s.next != h) { ++stat.bad_free; return; }
-#endif
-	size_t size = h->s.size;
-	if (likely(size < JP_ALLOC_POOL_COUNT)) {
-		pool_put(h, g_pools + size);
+	if (h == 0) return nullptr;
+	handle_entry &e = handle_get(h);
+	uint32_t s = e.state.load(std::memory_order_relaxed);
+	for (;;) {
+		if (unlikely(s & handle_moving)) {
+			sched_yield();
+			s = e.state.load(std::memory_order_relaxed);
+		}
+		else if (e.state.compare_exchange_weak(s, s + 1, std::memory_order_acquire)) {
+			return e.ptr.load(std::memory_order_relaxed);
+		}
 	}
-	else {
-                size_t pre_padding = reinterpret_cast<size_t>(mem) & (os_page_size() - 1);
-		os_free_pages(reinterpret_cast<char*>(h) + pre_padding, size + pre_padding);
+}
+
+void jp_hunpin(jp_handle h)
+{
+	if (h != 0) handle_get(h).state.fetch_sub(1, std::memory_order_release);
+}
+
+size_t jp_compact(unsigned max_density)
+{
+	return handle_compact(max_density);
+}
+
+bool jp_compact_start(const jp_compact_config &config)
+{
+	bool expected = false;
+	if (!g_handles.running.compare_exchange_strong(expected, true)) return false;
+	g_handles.config = config;
+	if (g_handles.config.interval_ms == 0) g_handles.config.interval_ms = 1;
+	g_handles.stop = false;
+	if (pthread_create(&g_handles.thread, nullptr, compact_thread, nullptr) != 0) {
+		g_handles.running = false;
+		return false;
 	}
+	return true;
+}
+
+void jp_compact_stop()
+{
+	if (!g_handles.running) return;
+	g_handles.stop = true;
+	pthread_join(g_handles.thread, nullptr);
+	g_handles.running = false;
 }
 
+static bool _compact = getenv("JP_ALLOC_COMPACT") && jp_compact_start(jp_compact_config());
+
 #ifdef DEBUG
 static int _ae = std::atexit(jpalloc_print_stats);
 #endif
 
+// Kernel dispatch. The resolvers run once while the library is relocated,
+// later calls go straight to the bound variant.
+
+#if defined(__x86_64__)
+
+using zero_fn = void (*)(void *, size_t);
+using copy_fn = void (*)(void *, const void *, size_t);
+
+extern "C" {
+
+static zero_fn resolve_zero()
+{
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f")) return jp::zero_avx512;
+	if (__builtin_cpu_supports("avx2")) return jp::zero_avx2;
+	return jp::zero_sse2;
+}
+
+static copy_fn resolve_copy()
+{
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f")) return jp::copy_avx512;
+	if (__builtin_cpu_supports("avx2")) return jp::copy_avx2;
+	return jp::copy_sse2;
+}
+
+}
+
+static void kernel_zero(void *mem, size_t n) __attribute__((ifunc("resolve_zero")));
+static void kernel_copy(void *dst, const void *src, size_t n) __attribute__((ifunc("resolve_copy")));
+
+#else
+
+static void kernel_zero(void *mem, size_t n) { jp::zero_generic(mem, n); }
+static void kernel_copy(void *dst, const void *src, size_t n) { jp::copy_generic(dst, src, n); }
+
+#endif
+
 void *jp_alloc(size_t size)
 {
 #ifdef DEBUG
         ++stat.jp_alloc;
 #endif
-	size += sizeof(header);
 	void *mem;
-	size_t pid = pool_id(size);
-	if (likely(pid < JP_ALLOC_POOL_COUNT)) {
-		mem = pool_get(g_pools + pid);
-        }
-        else {
-                size_t ps_mask = os_page_size() - 1;
-                size = (size + ps_mask) & ~ps_mask; // round to whole pages
-		mem = os_alloc_pages(size);
-		if (mem == nullptr) return nullptr;
-		header *h = static_cast<header*>(mem);
-		h->s.size = size;
-#ifdef DEBUG
-                h->s.next = h;
-#endif
+	if (unlikely(t_profile.depth)) {
+		unsigned long long start = now_ns();
+		mem = g_alloc.alloc(size);
+		profile_count(1, 0, size, start);
+	}
+	else {
+		mem = g_alloc.alloc(size);
 	}
+	if (unlikely(g_trace.sampling.load(std::memory_order_relaxed))) trace_sample(size, mem);
+	if (unlikely(size >= g_mergeable_min)) mark_large(mem);
+	return mem;
+}
+
+namespace {
 
-	return static_cast<header*>(mem) + 1;
+// Callsite size class prediction for operator new. Most sites allocate one
+// fixed size, so the class is looked up by return address instead of
+// computed. A slot packs the site's low 32 bits, the size (below 16 MB) and
+// the class in one word, so racing updates can't tear it, and the size is
+// compared, so a collision only costs the normal path. Misses are sampled
+// in, 1 in 16 per thread.
+// It measured no faster than computing the class on tools/bench_new.cpp, so
+// it's off by default. Then site_alloc is just jp_alloc and the unused return
+// address compiles away, so operator new keeps passing it at no cost and a
+// build can still try -DJP_ALLOC_SITE_CACHE on a workload of its own.
+
+#if JP_ALLOC_SITE_CACHE > 0
+std::atomic<uint64_t> g_sites[JP_ALLOC_SITE_CACHE];
+JP_TLS unsigned t_site_countdown;
+#endif
+
+inline void *site_alloc(size_t size, void *site)
+{
+#if JP_ALLOC_SITE_CACHE > 0
+   const uintptr_t s = reinterpret_cast<uintptr_t>(site);
+   std::atomic<uint64_t> &slot = g_sites[(s ^ s >> 12) % JP_ALLOC_SITE_CACHE];
+   const uint64_t e = slot.load(std::memory_order_relaxed);
+   if (likely(e >> 32 == (s & 0xffffffff) && (e >> 8 & 0xffffff) == size
+              && !t_profile.depth && !g_trace.sampling.load(std::memory_order_relaxed))) {
+#ifdef DEBUG
+      ++stat.jp_alloc;
+#endif
+      return g_alloc.alloc_class(size, e & 0xff);
+   }
+   if (size < (1 << 24) && t_site_countdown-- == 0) {
+      t_site_countdown = 15;
+      const size_t id = global_allocator::size_class::id(size + sizeof(jp::header));
+      if (id < global_allocator::size_class::count) slot.store((s & 0xffffffff) << 32 | size << 8 | id, std::memory_order_relaxed);
+   }
+#else
+   (void)site;
+#endif
+   return jp_alloc(size);
 }
 
+} // namespace
+
 void *jp_alloc_aligned(size_t alignment, size_t size)
 {
 #ifdef DEBUG
         ++stat.jp_alloc_aligned;
 #endif
-	size += sizeof(header);
-	void *mem = alloc_pages_aligned(alignment, size);
-        if (mem == nullptr) return nullptr;
-        header *h = static_cast<header*>(mem);
-        h->s.size = size;
-#ifdef DEBUG
-        h->s.next = h;
-#endif
-	return static_cast<header*>(mem) + 1;
+	void *mem;
+	if (unlikely(t_profile.depth)) {
+		unsigned long long start = now_ns();
+		mem = g_alloc.alloc_aligned(alignment, size);
+		profile_count(1, 0, size, start);
+	}
+	else {
+		mem = g_alloc.alloc_aligned(alignment, size);
+	}
+	if (unlikely(size >= g_mergeable_min)) mark_large(mem);
+	return mem;
 }
 
 void *jp_calloc(size_t num, size_t nsize)
@@ -300,27 +1797,26 @@ void *jp_calloc(size_t num, size_t nsize)
    }
 
    void *mem = jp_alloc(size);
-   if (mem) memset(mem, 0, size);
+   if (mem) kernel_zero(mem, size);
    return mem;
 }
 
 
 void *jp_realloc(void *mem, size_t new_size)
 {
-   // todo: consider using mremap for large allocations
 #ifdef DEBUG
         ++stat.jp_realloc;
 #endif
         size_t size = 0;
-        if (mem != nullptr) {
-           header *h = static_cast<header*>(mem) - 1;
-           size = h->s.size;
-           if (size < JP_ALLOC_POOL_COUNT) size = 1U << size;
-           size -= sizeof(header);
-        }
+        if (mem != nullptr) size = global_allocator::usable_size(mem);
         if (new_size > size) {
+           // page allocations are remapped instead of copied
+           if (mem != nullptr) {
+              if (void *new_mem = g_alloc.resize(mem, new_size)) return new_size >= g_mergeable_min ? mark_large(new_mem) : new_mem;
+           }
            void *new_mem = jp_alloc(new_size);
-           if (new_mem) memcpy(new_mem, mem, size);
+           if (new_mem == nullptr) return nullptr; // old block stays valid
+           if (mem) kernel_copy(new_mem, mem, size);
            jp_free(mem);
            mem = new_mem;
         }
@@ -331,6 +1827,62 @@ void *jp_realloc(void *mem, size_t new_size)
 	return mem;
 }
 
+void *jp_realloc_aligned(void *mem, size_t alignment, size_t new_size)
+{
+	if (mem == nullptr) return jp_alloc_aligned(alignment, new_size);
+	if (new_size == 0) {
+		jp_free(mem);
+		return nullptr;
+	}
+	if (unlikely(alignment & (alignment - 1))) return nullptr;
+	const size_t size = global_allocator::usable_size(mem);
+	if ((reinterpret_cast<size_t>(mem) & (alignment - 1)) == 0) {
+		if (new_size <= size) return mem;
+		if (void *new_mem = g_alloc.resize(mem, new_size, alignment)) return new_size >= g_mergeable_min ? mark_large(new_mem) : new_mem;
+	}
+	void *new_mem = jp_alloc_aligned(alignment, new_size);
+	if (new_mem == nullptr) return nullptr;
+	kernel_copy(new_mem, mem, std::min(size, new_size));
+	jp_free(mem);
+	return new_mem;
+}
+
+static bool _mergeable = getenv("JP_ALLOC_MERGEABLE") && (g_mergeable_min = strtoul(getenv("JP_ALLOC_MERGEABLE"), nullptr, 0) ?: SIZE_MAX) != SIZE_MAX;
+
+namespace {
+
+// alignment for JP_MERGEABLE, at least a page so the data starts a page of its
+// own and the header sits in the page before
+size_t mergeable_alignment(int flags)
+{
+	return std::max(os_page_size(), size_t(1) << (flags & JP_ALIGN_MASK));
+}
+
+void *mark_mergeable(void *mem, size_t size)
+{
+	if (mem != nullptr) {
+		const size_t ps_mask = os_page_size() - 1;
+		madvise(mem, (size + ps_mask) & ~ps_mask, MADV_MERGEABLE); // EINVAL without KSM, then it's just memory
+	}
+	return mem;
+}
+
+} // namespace
+
+void *jp_allocx(size_t size, int flags)
+{
+	if (flags & JP_MERGEABLE) return mark_mergeable(jp_alloc_aligned(mergeable_alignment(flags), size), size);
+	if (flags & JP_ALIGN_MASK) return jp_alloc_aligned(size_t(1) << (flags & JP_ALIGN_MASK), size);
+	return jp_alloc(size);
+}
+
+void *jp_reallocx(void *mem, size_t size, int flags)
+{
+	if (flags & JP_MERGEABLE) return mark_mergeable(jp_realloc_aligned(mem, mergeable_alignment(flags), size), size);
+	if (flags & JP_ALIGN_MASK) return jp_realloc_aligned(mem, size_t(1) << (flags & JP_ALIGN_MASK), size);
+	return jp_realloc(mem, size);
+}
+
 extern "C" void *reallocarray(void *ptr, size_t nmemb, size_t size)
 {
    size_t total_size = nmemb * size;
@@ -355,10 +1907,7 @@ extern "C" int posix_memalign(void **memptr, size_t alignment, size_t size)
 
 extern "C" size_t malloc_usable_size (void *ptr)
 {
-	header *h = reinterpret_cast<header*>(ptr) - 1;
-        size_t size = h->s.size;
-        if (size < JP_ALLOC_POOL_COUNT) size = 1U << size;
-	return size - sizeof(header);
+	return global_allocator::usable_size(ptr);
 }
 
 
@@ -394,10 +1943,10 @@ extern "C" void* __libc_pvalloc(size_t size) { return malloc(size); }
 extern "C" int __posix_memalign(void** r, size_t a, size_t s) { return posix_memalign(r, a, s); }
 
 
-void * operator new(std::size_t n) { return malloc(n); }
+void * operator new(std::size_t n) { return site_alloc(n, __builtin_return_address(0)); }
 void* operator new(size_t size, const std::nothrow_t& nt) noexcept { return malloc(size); }
 void operator delete(void * p) noexcept { jp_free(p); }
-void *operator new[](std::size_t s) { return malloc(s); }
+void *operator new[](std::size_t s) { return site_alloc(s, __builtin_return_address(0)); }
 void* operator new[](size_t size, const std::nothrow_t& nt) noexcept { return malloc(size); }
 void operator delete[](void *p) noexcept { jp_free(p); }
 
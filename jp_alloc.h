@@ -0,0 +1,1567 @@
+#ifndef JP_ALLOC_H
+#define JP_ALLOC_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <algorithm>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+#include <sys/mman.h>
+#include <sched.h>
+#include <unistd.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+#ifndef likely
+#ifdef __GNUC__
+#define likely(x)       __builtin_expect(!!(x), 1)
+#define unlikely(x)     __builtin_expect(!!(x), 0)
+#else
+#define likely(x)       (x)
+#define unlikely(x)     (x)
+#endif
+#endif
+
+// pop prefetches the header of the block the next pop returns, 0 to disable
+#ifndef JP_ALLOC_PREFETCH
+#define JP_ALLOC_PREFETCH 1
+#endif
+
+namespace jp {
+
+union header
+{
+   struct {
+      size_t size; // class id for pooled blocks, byte size for page allocations
+      header *next;
+   } s;
+   std::max_align_t _align;
+};
+
+// Start loading a freelist block's header, which the next pop reads for its
+// next pointer and the caller of that pop writes.
+inline void prefetch_block(header *h)
+{
+#if JP_ALLOC_PREFETCH
+   if (h != nullptr) __builtin_prefetch(h, 1);
+#endif
+}
+
+// Size class policies.
+// id() maps a block size (header included) to a class id, size() maps it back.
+// An empty class is refilled by splitting a block of the next class, so each
+// class size must be a multiple of the one below it.
+
+template <size_t Count>
+struct pow2_classes
+{
+   static constexpr size_t count = Count;
+
+   static size_t id(size_t size)
+   {
+      --size;
+      size_t id = 0;
+      while (size) ++id, size >>= 1;
+      return id;
+   }
+
+   static constexpr size_t size(size_t id) { return size_t(1) << id; }
+};
+
+struct spin_lock
+{
+   std::atomic<bool> busy;
+
+   void lock()
+   {
+      while (busy.exchange(true, std::memory_order_acquire)) sched_yield();
+   }
+
+   void unlock()
+   {
+      busy.store(false, std::memory_order_release);
+   }
+};
+
+// Held shared by any number of threads or exclusively by one. Shared holders
+// never wait behind a waiting exclusive one, so they may nest.
+struct shared_spin_lock
+{
+   std::atomic<long> state; // shared holders, -1 while held exclusively
+
+   void lock()
+   {
+      long s = 0;
+      while (!state.compare_exchange_weak(s, -1, std::memory_order_acquire)) s = 0, sched_yield();
+   }
+
+   void unlock()
+   {
+      state.store(0, std::memory_order_release);
+   }
+
+   void lock_shared()
+   {
+      long s = state.load(std::memory_order_relaxed);
+      for (;;) {
+         if (s < 0) {
+            sched_yield();
+            s = state.load(std::memory_order_relaxed);
+         }
+         else if (state.compare_exchange_weak(s, s + 1, std::memory_order_acquire)) {
+            return;
+         }
+      }
+   }
+
+   void unlock_shared()
+   {
+      state.fetch_sub(1, std::memory_order_release);
+   }
+};
+
+// Synchronization policies.
+// Each provides the freelist type used for a pool head. Heap walks lock() a
+// freelist, which stops push and pop until unlock(), and for_each() visits
+// the free blocks while it is locked.
+
+struct atomic_sync
+{
+   struct freelist
+   {
+      std::atomic<header*> head;
+      header *saved; // head while locked
+
+      // head value while a heap walk holds the list
+      static header *locked() { return reinterpret_cast<header*>(uintptr_t(1)); }
+
+      header *wait_unlocked()
+      {
+         header *h;
+         while ((h = head.load()) == locked()) sched_yield();
+         return h;
+      }
+
+      void push(header *h)
+      {
+         push_chain(h, h);
+      }
+
+      // push blocks already linked from first to last with one CAS
+      void push_chain(header *first, header *last)
+      {
+         header *expected = head;
+         do {
+            if (unlikely(expected == locked())) expected = wait_unlocked();
+            last->s.next = expected;
+         } while (!head.compare_exchange_weak(expected, first));
+      }
+
+      header *pop()
+      {
+         header *expected = head;
+         header *next;
+         do {
+            if (unlikely(expected == locked())) expected = wait_unlocked();
+            if (unlikely(expected == nullptr)) return nullptr;
+            next = expected->s.next;
+         } while (!head.compare_exchange_weak(expected, next));
+         prefetch_block(next);
+         return expected;
+      }
+
+      void lock()
+      {
+         header *h;
+         do h = wait_unlocked();
+         while (!head.compare_exchange_weak(h, locked()));
+         saved = h;
+      }
+
+      void unlock() { head.store(saved, std::memory_order_release); }
+
+      template <class F> void for_each(F fn) const
+      {
+         for (header *h = saved; h != nullptr; h = h->s.next) fn(h);
+      }
+   };
+};
+
+struct single_thread_sync
+{
+   struct freelist
+   {
+      header *head;
+
+      void push(header *h)
+      {
+         h->s.next = head;
+         head = h;
+      }
+
+      void push_chain(header *first, header *last)
+      {
+         last->s.next = head;
+         head = first;
+      }
+
+      header *pop()
+      {
+         header *h = head;
+         if (likely(h != nullptr)) {
+            head = h->s.next;
+            prefetch_block(head);
+         }
+         return h;
+      }
+
+      void lock() {}
+      void unlock() {}
+
+      template <class F> void for_each(F fn) const
+      {
+         for (header *h = head; h != nullptr; h = h->s.next) fn(h);
+      }
+   };
+};
+
+// One lock free list per cpu. pop falls back to the other cpus' lists before
+// reporting the pool empty, so blocks are never stranded on an idle cpu.
+template <size_t Shards = 64>
+struct per_cpu_sync
+{
+   struct freelist
+   {
+      struct alignas(64) shard_type : atomic_sync::freelist {};
+      shard_type shard[Shards];
+
+      static size_t current()
+      {
+         int cpu = sched_getcpu();
+         return cpu < 0 ? 0 : size_t(cpu) % Shards;
+      }
+
+      void push(header *h) { shard[current()].push(h); }
+      void push_chain(header *first, header *last) { shard[current()].push_chain(first, last); }
+
+      header *pop()
+      {
+         size_t cur = current();
+         for (size_t i = 0; i < Shards; ++i) {
+            header *h = shard[(cur + i) % Shards].pop();
+            if (h != nullptr) return h;
+         }
+         return nullptr;
+      }
+
+      void lock() { for (auto &s : shard) s.lock(); }
+      void unlock() { for (auto &s : shard) s.unlock(); }
+
+      template <class F> void for_each(F fn) const
+      {
+         for (auto &s : shard) s.for_each(fn);
+      }
+   };
+};
+
+// Page backends.
+// reserve() maps memory carved into pool blocks, alloc() maps page
+// allocations. Backends can treat reservations differently, e.g. prefault them.
+// remap() resizes a page allocation, moving it if allowed. prefault() faults
+// in a fresh mapping ahead of use.
+
+struct mmap_pages
+{
+   static size_t page_size()
+   {
+      return sysconf(_SC_PAGESIZE);
+   }
+
+   static void *alloc(size_t size)
+   {
+      void *mem = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (mem == MAP_FAILED) mem = nullptr;
+      return mem;
+   }
+
+   static void *reserve(size_t size)
+   {
+      return alloc(size);
+   }
+
+   // move or grow a mapping without copying, nullptr if it can't be done
+   static void *remap(void *mem, size_t old_size, size_t new_size, bool may_move = true)
+   {
+      void *p = mremap(mem, old_size, new_size, may_move ? MREMAP_MAYMOVE : 0);
+      if (p == MAP_FAILED) p = nullptr;
+      return p;
+   }
+
+   static void free(void *mem, size_t size)
+   {
+      munmap(mem, size);
+   }
+
+   static void prefault(void *mem, size_t size)
+   {
+      if (madvise(mem, size, MADV_POPULATE_WRITE) == 0) return; // linux 5.14
+      const size_t ps = page_size();
+      for (size_t i = 0; i < size; i += ps) static_cast<volatile char*>(mem)[i] = 0;
+   }
+};
+
+// Backend decorator caching freed page allocations per CPU. Threads that
+// alloc and free the same large sizes reuse them without mmap/munmap and the
+// kernel's mapping lock, and a CPU's cache is only contended when threads
+// migrate. Blocks up to MaxBlock bytes are matched by exact size, each CPU
+// keeps at most Slots of them and MaxBytes in total, evicting the oldest.
+// limit() narrows both at run time, e.g. to a container's cpus and memory.
+// Reused blocks hold old data, so the allocator maps its own tables, which
+// must start zeroed, through uncached.
+template <class Pages, size_t Shards = 16, size_t Slots = 16, size_t MaxBlock = 1 << 20, size_t MaxBytes = 2 << 20>
+struct cached_pages : Pages
+{
+   using uncached = Pages;
+
+   static void *alloc(size_t size)
+   {
+      if (size <= MaxBlock && size <= MaxBytes) {
+         shard &s = shards[current()];
+         s.mutex.lock();
+         for (size_t i = s.count; i-- > 0;) {
+            if (s.blocks[i].size != size) continue;
+            void *mem = s.blocks[i].mem;
+            std::copy(s.blocks + i + 1, s.blocks + s.count, s.blocks + i);
+            --s.count;
+            s.bytes -= size;
+            s.mutex.unlock();
+            return mem;
+         }
+         s.mutex.unlock();
+      }
+      return Pages::alloc(size);
+   }
+
+   static void free(void *mem, size_t size)
+   {
+      const size_t keep = budget.load(std::memory_order_relaxed);
+      if (size > MaxBlock || size > keep) {
+         Pages::free(mem, size);
+         return;
+      }
+      block evicted[Slots];
+      shard &s = shards[current()];
+      s.mutex.lock();
+      size_t n = evict(s, size, keep, evicted);
+      s.blocks[s.count++] = { mem, size };
+      s.bytes += size;
+      s.mutex.unlock();
+      // unmap outside the lock
+      for (size_t i = 0; i < n; ++i) Pages::free(evicted[i].mem, evicted[i].size);
+   }
+
+   // use only the first cpus shards and at most bytes per shard, unmapping
+   // what no longer fits
+   static void limit(size_t cpus, size_t bytes)
+   {
+      active.store(std::min(std::max<size_t>(cpus, 1), Shards), std::memory_order_relaxed);
+      budget.store(std::min(bytes, MaxBytes), std::memory_order_relaxed);
+      for (size_t i = 0; i < Shards; ++i) {
+         block evicted[Slots];
+         shard &s = shards[i];
+         s.mutex.lock();
+         size_t n = evict(s, 0, i < active ? budget.load(std::memory_order_relaxed) : 0, evicted);
+         s.mutex.unlock();
+         for (size_t j = 0; j < n; ++j) Pages::free(evicted[j].mem, evicted[j].size);
+      }
+   }
+
+   // hold every shard, e.g. across fork
+   static void lock_all()
+   {
+      for (auto &s : shards) s.mutex.lock();
+   }
+
+   static void unlock_all()
+   {
+      for (auto &s : shards) s.mutex.unlock();
+   }
+
+   static size_t cached_bytes()
+   {
+      size_t bytes = 0;
+      for (auto &s : shards) bytes += s.bytes;
+      return bytes;
+   }
+
+private:
+   struct block
+   {
+      void *mem;
+      size_t size;
+   };
+
+   struct alignas(64) shard
+   {
+      spin_lock mutex;
+      size_t count;
+      size_t bytes;
+      block blocks[Slots]; // oldest first
+   };
+
+   static inline shard shards[Shards];
+   static inline std::atomic<size_t> active = {Shards};
+   static inline std::atomic<size_t> budget = {MaxBytes};
+
+   static size_t current()
+   {
+      int cpu = sched_getcpu();
+      return cpu < 0 ? 0 : size_t(cpu) % active.load(std::memory_order_relaxed);
+   }
+
+   // take blocks off s, oldest first, until one more of size fits in keep
+   // bytes. Returns the number moved to out
+   static size_t evict(shard &s, size_t size, size_t keep, block *out)
+   {
+      size_t n = 0;
+      while (s.count > 0 && (s.count + (size != 0) > Slots || s.bytes + size > keep)) {
+         out[n++] = s.blocks[0];
+         s.bytes -= s.blocks[0].size;
+         std::copy(s.blocks + 1, s.blocks + s.count, s.blocks);
+         --s.count;
+      }
+      return n;
+   }
+};
+
+// Backend for memory that must come zeroed from the kernel: Pages::uncached
+// if Pages recycles blocks, else Pages itself.
+template <class Pages, class = void>
+struct fresh_pages { using type = Pages; };
+
+template <class Pages>
+struct fresh_pages<Pages, std::void_t<typename Pages::uncached>> { using type = typename Pages::uncached; };
+
+// Out of band registries for heap walks, kept on the slow paths only.
+
+// Mappings carved into pool blocks. These are never unmapped, so the list
+// only grows.
+template <class Pages>
+struct span_list
+{
+   struct span
+   {
+      char *addr;
+      size_t bytes;
+      size_t bit; // first bit in the walk bitmap
+   };
+
+   spin_lock mutex;
+   span *spans;
+   size_t count;
+   size_t capacity;
+
+   void add(char *addr, size_t bytes)
+   {
+      mutex.lock();
+      if (count == capacity) {
+         size_t cap = capacity ? capacity * 2 : Pages::page_size() / sizeof(span);
+         span *s = static_cast<span*>(Pages::alloc(cap * sizeof(span)));
+         if (s == nullptr) {
+            mutex.unlock();
+            return;
+         }
+         if (spans) {
+            std::copy(spans, spans + count, s);
+            Pages::free(spans, capacity * sizeof(span));
+         }
+         spans = s;
+         capacity = cap;
+      }
+      spans[count++] = { addr, bytes, 0 };
+      mutex.unlock();
+   }
+
+   // span holding p, spans must be sorted
+   span *find(const void *p) const
+   {
+      span *s = std::upper_bound(spans, spans + count, p, [](const void *p, const span &s) { return p < s.addr; });
+      return s == spans ? nullptr : s - 1;
+   }
+};
+
+// Live page allocations, an open addressing hash set of their headers.
+template <class Pages>
+struct page_set
+{
+   spin_lock mutex;
+   header **table;
+   size_t count;
+   size_t capacity;
+
+   static size_t hash(header *h) { return (reinterpret_cast<uintptr_t>(h) >> 5) * 0x9e3779b97f4a7c15ULL; }
+
+   void insert(header *h)
+   {
+      mutex.lock();
+      if (2 * (count + 1) > capacity) grow();
+      if (2 * (count + 1) <= capacity) {
+         size_t i = hash(h) & (capacity - 1);
+         while (table[i] != nullptr) i = (i + 1) & (capacity - 1);
+         table[i] = h;
+         ++count;
+      }
+      mutex.unlock();
+   }
+
+   void erase(header *h)
+   {
+      mutex.lock();
+      if (capacity) {
+         const size_t mask = capacity - 1;
+         size_t i = hash(h) & mask;
+         while (table[i] != nullptr && table[i] != h) i = (i + 1) & mask;
+         if (table[i] != nullptr) {
+            // backward shift deletion keeps probe chains intact without tombstones
+            size_t j = i;
+            for (;;) {
+               j = (j + 1) & mask;
+               if (table[j] == nullptr) break;
+               // entry stays if its home slot lies cyclically in (i, j]
+               size_t home = hash(table[j]) & mask;
+               if (i <= j ? (i < home && home <= j) : (i < home || home <= j)) continue;
+               table[i] = table[j];
+               i = j;
+            }
+            table[i] = nullptr;
+            --count;
+         }
+      }
+      mutex.unlock();
+   }
+
+   template <class F> void for_each(F fn) const
+   {
+      for (size_t i = 0; i < capacity; ++i) {
+         if (table[i] != nullptr) fn(table[i]);
+      }
+   }
+
+   void grow()
+   {
+      size_t cap = capacity ? capacity * 2 : Pages::page_size() / sizeof(header*);
+      header **t = static_cast<header**>(Pages::alloc(cap * sizeof(header*)));
+      if (t == nullptr) return;
+      for (size_t i = 0; i < capacity; ++i) {
+         if (table[i] == nullptr) continue;
+         size_t j = hash(table[i]) & (cap - 1);
+         while (t[j] != nullptr) j = (j + 1) & (cap - 1);
+         t[j] = table[i];
+      }
+      if (table) Pages::free(table, capacity * sizeof(header*));
+      table = t;
+      capacity = cap;
+   }
+};
+
+// Stats policies.
+// check_free marks allocated blocks so free() can reject pointers it did not hand out.
+// on_request sees the size asked for and the block size granted for it.
+
+struct no_stats
+{
+   static constexpr bool check_free = false;
+   struct pool_stat {};
+   static void on_call(pool_stat &) {}
+   static void on_get(pool_stat &) {}
+   static void on_put(pool_stat &) {}
+   static void on_map(pool_stat &) {}
+   static void on_split(pool_stat &, pool_stat &) {}
+   static void on_request(pool_stat &, size_t, size_t) {}
+};
+
+struct counting_stats
+{
+   static constexpr bool check_free = true;
+   struct pool_stat
+   {
+      std::atomic<unsigned long> alloc_calls;
+      std::atomic<unsigned long> alloc_count;
+      std::atomic<unsigned long> free_count;
+      // sampled, every sample_rate'th call. internal fragmentation is 1 - requested / granted
+      std::atomic<unsigned long long> requested;
+      std::atomic<unsigned long long> granted;
+   };
+   static constexpr unsigned long sample_rate = 16;
+   static void on_call(pool_stat &s) { s.alloc_calls++; }
+   static void on_get(pool_stat &s) { s.alloc_count++, s.free_count--; }
+   static void on_put(pool_stat &s) { s.alloc_count--, s.free_count++; }
+   static void on_map(pool_stat &s) { s.alloc_count++; }
+   // one parent allocation becomes two allocated in child
+   static void on_split(pool_stat &parent, pool_stat &child) { parent.alloc_count--, child.alloc_count += 2; }
+   static void on_request(pool_stat &s, size_t requested, size_t granted)
+   {
+      if (s.alloc_calls.load(std::memory_order_relaxed) % sample_rate != 0) return;
+      s.requested.fetch_add(requested, std::memory_order_relaxed);
+      s.granted.fetch_add(granted, std::memory_order_relaxed);
+   }
+};
+
+// Pool allocator core. Requests that fit a size class are served from that
+// class' freelist, anything larger goes straight to the page backend.
+// The global malloc is one instantiation of this, see jp_alloc.cpp.
+
+template <class SizeClass, class Sync, class Pages, class Stats>
+class pool_allocator
+{
+public:
+   using size_class = SizeClass;
+   using sync = Sync;
+   using pages = Pages;
+   using stats = Stats;
+   using table_pages = typename fresh_pages<Pages>::type; // registries, walk bitmap, scratch
+
+   void *alloc(size_t size)
+   {
+      const size_t requested = size;
+      size += sizeof(header);
+      size_t pid = SizeClass::id(size);
+      if (likely(pid < SizeClass::count)) return alloc_class(requested, pid);
+      size_t ps_mask = Pages::page_size() - 1;
+      size = (size + ps_mask) & ~ps_mask; // round to whole pages
+      header *h = static_cast<header*>(Pages::alloc(size));
+      if (h == nullptr) return nullptr;
+      h->s.size = size;
+      if (Stats::check_free) h->s.next = h;
+      larges.insert(h);
+      large_bytes.fetch_add(size, std::memory_order_relaxed);
+      Stats::on_call(large);
+      Stats::on_request(large, requested, size);
+      return h + 1;
+   }
+
+   // alloc for a size the caller already knows falls in pool id
+   void *alloc_class(size_t size, size_t id)
+   {
+      header *h = pool_get(id);
+      if (unlikely(h == nullptr)) return nullptr;
+      Stats::on_request(pools[id].stat, size, SizeClass::size(id));
+      return h + 1;
+   }
+
+   void *alloc_aligned(size_t alignment, size_t size)
+   {
+      const size_t requested = size;
+      size += sizeof(header);
+      header *h = static_cast<header*>(alloc_pages_aligned(alignment, size));
+      if (h == nullptr) return nullptr;
+      h->s.size = size;
+      if (Stats::check_free) h->s.next = h;
+      larges.insert(h);
+      large_bytes.fetch_add(size, std::memory_order_relaxed);
+      Stats::on_call(large);
+      Stats::on_request(large, requested, (size + Pages::page_size() - 1) & ~(Pages::page_size() - 1));
+      return h + 1;
+   }
+
+   // returns false if mem was rejected as a bad free
+   bool free(void *mem)
+   {
+      header *h = static_cast<header*>(mem) - 1;
+      if (Stats::check_free && h->s.next != h) return false;
+      free_block(h);
+      return true;
+   }
+
+   // true if mem looks like a block handed out by this allocator. Always true
+   // without check_free
+   static bool owns(void *mem)
+   {
+      header *h = static_cast<header*>(mem) - 1;
+      return !Stats::check_free || h->s.next == h;
+   }
+
+   // Free a chain of blocks linked through their headers' next field, as
+   // built by deferred frees. Blocks of the same class go back to their pool
+   // with one splice.
+   void free_chain(header *h)
+   {
+      header *first[SizeClass::count] = {};
+      header *last[SizeClass::count];
+      size_t count[SizeClass::count];
+      while (h != nullptr) {
+         header *next = h->s.next;
+         size_t id = h->s.size;
+         if (likely(id < SizeClass::count)) {
+            if (first[id] == nullptr) last[id] = h, count[id] = 0;
+            h->s.next = first[id];
+            first[id] = h;
+            ++count[id];
+         }
+         else {
+            free_block(h);
+         }
+         h = next;
+      }
+      for (size_t id = 0; id < SizeClass::count; ++id) {
+         if (first[id] == nullptr) continue;
+         for (size_t i = 0; i < count[id]; ++i) Stats::on_put(pools[id].stat);
+         pools[id].list.push_chain(first[id], last[id]);
+      }
+   }
+
+   // Free count blocks at once, reordering mem. The pointers are sorted by
+   // page first, so headers are visited in address order rather than at
+   // random, then each class goes back to its pool with one splice, lowest
+   // address on top. Null pointers are skipped. Returns the number of bad
+   // frees rejected.
+   size_t free_batch(void **mem, size_t count)
+   {
+      sort_by_page(mem, count);
+      header *first[SizeClass::count] = {};
+      header *last[SizeClass::count];
+      size_t n[SizeClass::count];
+      size_t bad = 0;
+      // backwards, so the chains come out in ascending order
+      for (size_t i = count; i-- > 0;) {
+         if (i >= 8 && mem[i - 8]) __builtin_prefetch(static_cast<header*>(mem[i - 8]) - 1, 1);
+         if (mem[i] == nullptr) continue;
+         header *h = static_cast<header*>(mem[i]) - 1;
+         if (Stats::check_free && h->s.next != h) {
+            ++bad;
+            continue;
+         }
+         size_t id = h->s.size;
+         if (likely(id < SizeClass::count)) {
+            if (first[id] == nullptr) last[id] = h, n[id] = 0;
+            h->s.next = first[id];
+            first[id] = h;
+            ++n[id];
+         }
+         else {
+            free_block(h);
+         }
+      }
+      for (size_t id = 0; id < SizeClass::count; ++id) {
+         if (first[id] == nullptr) continue;
+         for (size_t i = 0; i < n[id]; ++i) Stats::on_put(pools[id].stat);
+         pools[id].list.push_chain(first[id], last[id]);
+      }
+      return bad;
+   }
+
+   // Resize without copying when the block's own memory allows it: page
+   // allocations are remapped by the backend. A moved block keeps its offset
+   // in the first page, so alignments up to the page size survive; larger
+   // alignments only grow in place. nullptr means the caller has to
+   // allocate, copy and free.
+   void *resize(void *mem, size_t new_size, size_t alignment = 0)
+   {
+      header *h = static_cast<header*>(mem) - 1;
+      const size_t old_size = h->s.size;
+      const size_t ps_mask = Pages::page_size() - 1;
+      if (old_size < SizeClass::count || SizeClass::id(new_size + sizeof(header)) < SizeClass::count) return nullptr;
+      // aligned allocations have padding before the header
+      const size_t pre_padding = reinterpret_cast<size_t>(h) & ps_mask;
+      char *start = reinterpret_cast<char*>(h) - pre_padding;
+      const size_t old_bytes = (pre_padding + old_size + ps_mask) & ~ps_mask;
+      const size_t new_bytes = (pre_padding + new_size + sizeof(header) + ps_mask) & ~ps_mask;
+      // a walk reads the header of every registered page allocation
+      carve_mutex.lock_shared();
+      if (new_bytes != old_bytes) {
+         char *p = static_cast<char*>(Pages::remap(start, old_bytes, new_bytes, alignment <= ps_mask + 1));
+         if (p == nullptr) {
+            carve_mutex.unlock_shared();
+            return nullptr;
+         }
+         larges.erase(h);
+         h = reinterpret_cast<header*>(p + pre_padding);
+         larges.insert(h);
+      }
+      h->s.size = new_bytes - pre_padding;
+      carve_mutex.unlock_shared();
+      large_bytes.fetch_add(new_bytes - pre_padding - old_size, std::memory_order_relaxed);
+      if (Stats::check_free) h->s.next = h;
+      return h + 1;
+   }
+
+   static size_t usable_size(void *mem)
+   {
+      header *h = static_cast<header*>(mem) - 1;
+      size_t size = h->s.size;
+      if (size < SizeClass::count) size = SizeClass::size(size);
+      return size - sizeof(header);
+   }
+
+   static size_t good_size(size_t size)
+   {
+      size += sizeof(header);
+      size_t pid = SizeClass::id(size);
+      if (likely(pid < SizeClass::count)) {
+         size = SizeClass::size(pid);
+      }
+      else {
+         size_t ps_mask = Pages::page_size() - 1;
+         size = (size + ps_mask) & ~ps_mask; // round to whole pages
+      }
+      return size - sizeof(header);
+   }
+
+   typename Stats::pool_stat &pool_stats(size_t id) { return pools[id].stat; }
+   typename Stats::pool_stat &large_stats() { return large; }
+
+   // Number of top class blocks the last pool maps per backend call.
+   // Larger batches mean fewer syscalls at the cost of more mapped memory.
+   size_t refill_blocks() const { return refill_batch.load(std::memory_order_relaxed); }
+   void refill_blocks(size_t n) { refill_batch.store(n ? n : 1, std::memory_order_relaxed); }
+
+   // Carve count blocks of pool id from one fresh, prefaulted reservation, so
+   // a burst finds them ready instead of refilling and splitting on the way.
+   // false if the memory can't be mapped.
+   bool prefill(size_t id, size_t count)
+   {
+      if (id >= SizeClass::count || count == 0) return false;
+      const size_t sz = SizeClass::size(id);
+      if (count > SIZE_MAX / sz) return false;
+      char *mem = static_cast<char*>(Pages::reserve(count * sz));
+      if (mem == nullptr) return false;
+      Pages::prefault(mem, count * sz);
+      refill_bytes.fetch_add(count * sz, std::memory_order_relaxed);
+      carve_mutex.lock_shared();
+      header *first = reinterpret_cast<header*>(mem);
+      header *last = reinterpret_cast<header*>(mem + (count - 1) * sz);
+      for (size_t i = 0; i < count; ++i) {
+         header *h = reinterpret_cast<header*>(mem + i * sz);
+         h->s.size = id;
+         h->s.next = h == last ? nullptr : reinterpret_cast<header*>(mem + (i + 1) * sz);
+         Stats::on_map(pools[id].stat);
+         Stats::on_put(pools[id].stat);
+      }
+      spans.add(mem, count * sz);
+      pools[id].list.push_chain(first, last);
+      carve_mutex.unlock_shared();
+      return true;
+   }
+
+   // backend calls made to refill the last pool, and bytes mapped by them
+   unsigned long refills() const { return refill_calls.load(std::memory_order_relaxed); }
+   unsigned long long refilled_bytes() const { return refill_bytes.load(std::memory_order_relaxed); }
+
+   // bytes held by live page allocations
+   size_t page_bytes() const { return large_bytes.load(std::memory_order_relaxed); }
+
+   // Hold every lock the allocator takes, in the order a walk takes them.
+   // Called from a pthread_atfork prepare handler, with unlock_all() in the
+   // parent and child handlers, a forked child doesn't inherit a lock held
+   // by a thread it doesn't have.
+   void lock_all()
+   {
+      walk_mutex.lock();
+      carve_mutex.lock();
+      larges.mutex.lock();
+      spans.mutex.lock();
+   }
+
+   void unlock_all()
+   {
+      spans.mutex.unlock();
+      larges.mutex.unlock();
+      carve_mutex.unlock();
+      walk_mutex.unlock();
+   }
+
+   // Visit every allocated block as fn(void *ptr, size_t usable_size, size_t id),
+   // id is SizeClass::count for page allocations. All other calls into the
+   // allocator wait until the walk is done, so fn must not allocate or free.
+   // Free blocks are marked in a bitmap outside the heap, then each span is
+   // walked by the headers' class ids. Returns false if the bitmap could not
+   // be mapped.
+   template <class F> bool walk(F fn)
+   {
+      walk_mutex.lock();
+      carve_mutex.lock();
+      larges.mutex.lock();
+      spans.mutex.lock();
+      for (auto &p : pools) p.list.lock();
+
+      const size_t granule = SizeClass::size(SizeClass::id(sizeof(header)));
+      auto *first = spans.spans, *last = spans.spans + spans.count;
+      std::sort(first, last, [](const auto &a, const auto &b) { return a.addr < b.addr; });
+      size_t bits = 0;
+      for (auto *s = first; s != last; ++s) s->bit = bits, bits += s->bytes / granule;
+      const size_t map_bytes = ((bits + 63) / 64 * 8 + Pages::page_size() - 1) & ~(Pages::page_size() - 1);
+      uint64_t *map = map_bytes ? static_cast<uint64_t*>(table_pages::alloc(map_bytes)) : nullptr;
+      const bool ok = map != nullptr || map_bytes == 0;
+
+      if (ok) {
+         for (auto &p : pools) {
+            p.list.for_each([&](header *h) {
+               auto *s = spans.find(h);
+               if (s == nullptr) return;
+               size_t bit = s->bit + (reinterpret_cast<char*>(h) - s->addr) / granule;
+               map[bit / 64] |= uint64_t(1) << (bit % 64);
+            });
+         }
+         for (auto *s = first; s != last; ++s) {
+            for (size_t off = 0; off < s->bytes; ) {
+               header *h = reinterpret_cast<header*>(s->addr + off);
+               size_t id = h->s.size;
+               if (id >= SizeClass::count) break; // corrupt header, skip rest of span
+               size_t bit = s->bit + off / granule;
+               if (!(map[bit / 64] & (uint64_t(1) << (bit % 64)))) fn(static_cast<void*>(h + 1), SizeClass::size(id) - sizeof(header), id);
+               off += SizeClass::size(id);
+            }
+         }
+         larges.for_each([&](header *h) { fn(static_cast<void*>(h + 1), usable_size(h + 1), SizeClass::count); });
+         if (map) table_pages::free(map, map_bytes);
+      }
+
+      for (auto &p : pools) p.list.unlock();
+      spans.mutex.unlock();
+      larges.mutex.unlock();
+      carve_mutex.unlock();
+      walk_mutex.unlock();
+      return ok;
+   }
+
+private:
+   struct pool
+   {
+      typename Stats::pool_stat stat;
+      typename Sync::freelist list;
+   };
+
+   pool pools[SizeClass::count] = {};
+   typename Stats::pool_stat large = {}; // page allocations
+   std::atomic<size_t> refill_batch = {1};
+   std::atomic<unsigned long> refill_calls = {};
+   std::atomic<unsigned long long> refill_bytes = {};
+   std::atomic<size_t> large_bytes = {};
+   spin_lock walk_mutex = {};
+   shared_spin_lock carve_mutex = {}; // shared while headers change under the walk's feet
+   span_list<table_pages> spans = {};
+   page_set<table_pages> larges = {};
+
+   void free_block(header *h)
+   {
+      size_t size = h->s.size;
+      if (likely(size < SizeClass::count)) {
+         pool_put(h, size);
+      }
+      else {
+         larges.erase(h);
+         large_bytes.fetch_sub(size, std::memory_order_relaxed);
+         // mapping starts at the page holding the header
+         const size_t ps_mask = Pages::page_size() - 1;
+         size_t pre_padding = reinterpret_cast<size_t>(h) & ps_mask;
+         Pages::free(reinterpret_cast<char*>(h) - pre_padding, (size + pre_padding + ps_mask) & ~ps_mask);
+      }
+   }
+
+   // LSD radix sort of pointers by page number, 8 bits a pass over only the
+   // bits that differ within the batch. Left unsorted if there's no scratch.
+   static void sort_by_page(void **mem, size_t count)
+   {
+      if (count < 64) {
+         std::sort(mem, mem + count, [](void *a, void *b) { return uintptr_t(a) < uintptr_t(b); });
+         return;
+      }
+      const unsigned page_shift = __builtin_ctzl(Pages::page_size());
+      uintptr_t lo = UINTPTR_MAX, hi = 0;
+      for (size_t i = 0; i < count; ++i) {
+         uintptr_t page = uintptr_t(mem[i]) >> page_shift;
+         lo = std::min(lo, page);
+         hi = std::max(hi, page);
+      }
+      void *stack[512];
+      const size_t scratch_bytes = count * sizeof(void*);
+      void **src = mem, **dst = count <= 512 ? stack : static_cast<void**>(table_pages::alloc(scratch_bytes));
+      if (dst == nullptr) return;
+      void **scratch = dst;
+      for (unsigned shift = 0; shift < sizeof(uintptr_t) * 8 && (hi - lo) >> shift != 0; shift += 8) {
+         size_t pos[256] = {};
+         for (size_t i = 0; i < count; ++i) ++pos[(((uintptr_t(src[i]) >> page_shift) - lo) >> shift) & 255];
+         for (size_t d = 0, sum = 0; d < 256; ++d) {
+            size_t c = pos[d];
+            pos[d] = sum;
+            sum += c;
+         }
+         for (size_t i = 0; i < count; ++i) dst[pos[(((uintptr_t(src[i]) >> page_shift) - lo) >> shift) & 255]++] = src[i];
+         std::swap(src, dst);
+      }
+      if (src != mem) std::copy(src, src + count, mem);
+      if (scratch != stack) table_pages::free(scratch, scratch_bytes);
+   }
+
+   void pool_put(header *h, size_t id)
+   {
+      Stats::on_put(pools[id].stat);
+      pools[id].list.push(h);
+   }
+
+   header *pool_get(size_t id)
+   {
+      pool &p = pools[id];
+      header *h = p.list.pop();
+      if (likely(h != nullptr)) {
+         // Normal case. Grap memory from pool
+         Stats::on_get(p.stat);
+      }
+      else if (id == SizeClass::count - 1) {
+         // Last pool. Ask backend for memory, refill_batch blocks at a time
+         const size_t sz = SizeClass::size(id);
+         size_t n = refill_blocks();
+         char *mem = static_cast<char*>(Pages::reserve(n * sz));
+         if (unlikely(mem == nullptr && n > 1)) mem = static_cast<char*>(Pages::reserve(sz)), n = 1;
+         if (likely(mem != nullptr)) {
+            refill_calls.fetch_add(1, std::memory_order_relaxed);
+            refill_bytes.fetch_add(n * sz, std::memory_order_relaxed);
+            // a walk may only see the span once every header is in place
+            carve_mutex.lock_shared();
+            for (size_t i = 0; i < n; ++i) {
+               reinterpret_cast<header*>(mem + i * sz)->s.size = id;
+               Stats::on_map(p.stat);
+            }
+            spans.add(mem, n * sz);
+            for (size_t i = 1; i < n; ++i) pool_put(reinterpret_cast<header*>(mem + i * sz), id);
+            carve_mutex.unlock_shared();
+            h = reinterpret_cast<header*>(mem);
+         }
+      }
+      else {
+         // Get from next pool and split. The spare headers land in what a
+         // walk saw as one block, so it waits until they are all written
+         carve_mutex.lock_shared();
+         char *mem = reinterpret_cast<char*>(pool_get(id + 1));
+         if (mem != nullptr) {
+            const size_t sz = SizeClass::size(id);
+            const size_t n = SizeClass::size(id + 1) / sz;
+            h = reinterpret_cast<header*>(mem);
+            h->s.size = id;
+            Stats::on_split(pools[id + 1].stat, p.stat);
+            for (size_t i = 1; i < n; ++i) {
+               header *spare = reinterpret_cast<header*>(mem + i * sz);
+               spare->s.size = id;
+               if (i > 1) Stats::on_map(p.stat);
+               pool_put(spare, id);
+            }
+         }
+         carve_mutex.unlock_shared();
+      }
+      Stats::on_call(p.stat);
+      if (Stats::check_free && h) h->s.next = h;
+      return h;
+   }
+
+   void *alloc_pages_aligned(size_t alignment, size_t size)
+   {
+      if (unlikely((alignment & (alignment - 1)) != 0)) return nullptr;
+      const size_t ps = Pages::page_size();
+      size_t pre_padding = 0; // space needed before header to align final pointer
+      size_t align_size = 0; // extra space needed to ensure we can get correct alignment in span
+      if (alignment > ps) {
+         pre_padding = ps - sizeof(header);
+         align_size = alignment - ps; // need alignment pages - 1 to ensure alignment
+      }
+      else if (alignment > sizeof(header)) {
+         pre_padding = alignment - sizeof(header);
+      }
+      else {
+         alignment = sizeof(header); // minimum alignment.
+      }
+      size_t span_size = pre_padding + size + align_size;
+      size_t span_size_rounded = (span_size + ps - 1) & ~(ps - 1); // round to whole pages
+      char *span = static_cast<char*>(Pages::alloc(span_size_rounded));
+      if (unlikely(span == nullptr)) return nullptr;
+      char *hdr = span + pre_padding;
+      size_t offset = (alignment - (reinterpret_cast<size_t>(hdr + sizeof(header)) & (alignment - 1))) & (alignment - 1);
+      hdr += offset;
+      if (align_size > 0) {
+         // if we have align pages, offset will be in whole pages (alignment > page size)
+         // free pre and post align pages
+         size_t pre_size = offset;
+         size_t post_size = align_size - pre_size;
+         if (pre_size > 0) Pages::free(span, pre_size);
+         if (post_size > 0) Pages::free(span + span_size_rounded - post_size, post_size);
+      }
+      return hdr;
+   }
+};
+
+// Bulk memory kernels for calloc zeroing and realloc copies.
+// Below nt_bytes they are memset/memcpy. From there on the x86 variants
+// write with non-temporal stores, since a block that large would only
+// evict the working set from the cache. Each variant is compiled for its
+// instruction set, so one binary carries all of them; jp_alloc.so binds the
+// best one the cpu supports once at load (an ifunc).
+
+constexpr size_t nt_bytes = 32 << 20;
+
+inline void zero_generic(void *mem, size_t n) { memset(mem, 0, n); }
+inline void copy_generic(void *dst, const void *src, size_t n) { memcpy(dst, src, n); }
+
+#if defined(__x86_64__)
+
+// V is the vector type, 64 bytes a loop iteration
+#define JP_NT_KERNELS(name, isa, V, zero, load, stream)                                   \
+__attribute__((target(isa))) inline void zero_##name(void *mem, size_t n)                \
+{                                                                                         \
+   if (n < nt_bytes) return (void)memset(mem, 0, n);                                      \
+   char *p = static_cast<char*>(mem);                                                     \
+   const size_t head = -reinterpret_cast<uintptr_t>(p) & (sizeof(V) - 1);                 \
+   memset(p, 0, head);                                                                    \
+   p += head, n -= head;                                                                  \
+   const V z = zero();                                                                    \
+   for (; n >= 64; n -= 64, p += 64) {                                                    \
+      for (size_t i = 0; i < 64; i += sizeof(V)) stream(reinterpret_cast<V*>(p + i), z);   \
+   }                                                                                      \
+   _mm_sfence();                                                                          \
+   memset(p, 0, n);                                                                       \
+}                                                                                         \
+__attribute__((target(isa))) inline void copy_##name(void *dst, const void *src, size_t n) \
+{                                                                                         \
+   if (n < nt_bytes) return (void)memcpy(dst, src, n);                                    \
+   char *d = static_cast<char*>(dst);                                                     \
+   const char *s = static_cast<const char*>(src);                                         \
+   const size_t head = -reinterpret_cast<uintptr_t>(d) & (sizeof(V) - 1);                 \
+   memcpy(d, s, head);                                                                    \
+   d += head, s += head, n -= head;                                                       \
+   for (; n >= 64; n -= 64, d += 64, s += 64) {                                           \
+      for (size_t i = 0; i < 64; i += sizeof(V))                                          \
+         stream(reinterpret_cast<V*>(d + i), load(reinterpret_cast<const V*>(s + i)));    \
+   }                                                                                      \
+   _mm_sfence();                                                                          \
+   memcpy(d, s, n);                                                                       \
+}
+
+JP_NT_KERNELS(sse2, "sse2", __m128i, _mm_setzero_si128, _mm_loadu_si128, _mm_stream_si128)
+JP_NT_KERNELS(avx2, "avx2", __m256i, _mm256_setzero_si256, _mm256_loadu_si256, _mm256_stream_si256)
+JP_NT_KERNELS(avx512, "avx512f", __m512i, _mm512_setzero_si512, _mm512_loadu_si512, _mm512_stream_si512)
+
+#undef JP_NT_KERNELS
+
+#endif
+
+} // namespace jp
+
+// Allocator entry points, also exported as malloc, free etc.
+
+void *jp_alloc(size_t size);
+void *jp_alloc_aligned(size_t alignment, size_t size);
+void *jp_calloc(size_t num, size_t nsize);
+void *jp_realloc(void *mem, size_t new_size);
+void *jp_realloc_aligned(void *mem, size_t alignment, size_t new_size);
+void jp_free(void *mem);
+void jp_free_batch(void **mem, size_t count); // reorders mem, skips nulls
+size_t jp_good_size(size_t size);
+
+// Deferred free for lock free data structures.
+// Readers bracket their accesses with jp_read_enter/jp_read_exit (they nest).
+// jp_retire frees a block once no reader that could still see it remains, using
+// a global epoch: retired blocks are batched per thread and returned to the
+// pools in bulk two epochs later, checked every 64 retires and every 16th
+// outermost jp_read_exit while blocks wait. Blocks must come from this
+// allocator.
+
+void jp_read_enter();
+void jp_read_exit();
+void jp_retire(void *mem);
+
+class jp_read_scope
+{
+public:
+   jp_read_scope() { jp_read_enter(); }
+   ~jp_read_scope() { jp_read_exit(); }
+   jp_read_scope(const jp_read_scope &) = delete;
+   jp_read_scope &operator=(const jp_read_scope &) = delete;
+};
+
+// Burst hint.
+// jp_expect tells the allocator count blocks of size are about to be
+// allocated. A background thread maps, prefaults and carves them into the
+// pool of that size class at once, so the burst doesn't find the pool empty
+// and split its way down from the last pool. Returns false for sizes served
+// by page allocations or when too many hints are pending.
+
+bool jp_expect(size_t size, size_t count);
+
+// Movable allocations.
+// jp_halloc returns a handle instead of a pointer, 0 on failure. jp_hpin
+// returns the object's current address and keeps it there until the
+// matching jp_hunpin (pins nest). Unpinned objects may be moved by the
+// compactor, so pointers from one pin must not be used after the unpin.
+// The compactor moves the live objects out of sparse chunks and unmaps the
+// chunks left empty. It runs every interval_ms on chunks under max_density
+// percent live, or once when jp_compact is called, which returns the bytes
+// released. Passes never overlap: jp_compact waits for one running on the
+// compactor thread to finish before starting its own. The compactor thread
+// also starts at load with JP_ALLOC_COMPACT=1. Objects over 32 KB are
+// ordinary allocations that never move.
+
+using jp_handle = uint32_t;
+
+jp_handle jp_halloc(size_t size);
+void jp_hfree(jp_handle h);
+void *jp_hpin(jp_handle h);
+void jp_hunpin(jp_handle h);
+
+struct jp_compact_config
+{
+   unsigned interval_ms = 1000;
+   unsigned max_density = 50;
+};
+
+bool jp_compact_start(const jp_compact_config &config);
+void jp_compact_stop();
+size_t jp_compact(unsigned max_density = 50);
+
+// Fast exit.
+// jp_fast_exit turns every later free into a no-op, so a process that is about
+// to exit does not spend its teardown returning memory that dies with it.
+// jp_fast_exit_on_exit arranges for that to happen when exit processing starts,
+// on a call to exit or a return from main, so atexit handlers and static
+// destructors run with frees dropped. Both are hooked by symbol interposition,
+// so the library has to come before libc, as it does when preloaded or linked
+// in. It can be called any time before exit. Setting JP_ALLOC_FAST_EXIT in the
+// environment calls it at load. The hooks are in place whether or not it is
+// called; a library built with -DJP_ALLOC_EXIT_HOOKS=0 has none and returns
+// false here.
+
+void jp_fast_exit();
+bool jp_fast_exit_on_exit();
+
+// Extended API. flags is JP_ALIGN(alignment), or 0 for the default alignment,
+// optionally or'ed with JP_MERGEABLE. jp_reallocx keeps the requested
+// alignment, like jp_realloc_aligned.
+// JP_MERGEABLE puts the block on pages of its own, apart from the pools,
+// and marks them MADV_MERGEABLE so kernel samepage merging can share
+// identical read-mostly data between processes. Pass it to jp_reallocx too.
+// JP_ALLOC_MERGEABLE=bytes marks every page allocation of at least that size
+// as it is made or grown. Pool spans are never marked.
+
+#define JP_ALIGN(a) (__builtin_ctzl(a))
+#define JP_ALIGN_MASK 0x3f
+#define JP_MERGEABLE 0x40
+
+void *jp_allocx(size_t size, int flags);
+void *jp_reallocx(void *mem, size_t size, int flags);
+
+// Scoped allocation profiler.
+// Everything the current thread does in the allocator between jp_profile_begin
+// and jp_profile_end is added to the counters of the named scope. Scopes nest,
+// an outer scope includes its inner scopes. name must have static storage
+// duration, scopes with the same name string share counters.
+
+#ifndef JP_PROFILE_DEPTH
+#define JP_PROFILE_DEPTH 32
+#endif
+
+#ifndef JP_PROFILE_SCOPES
+#define JP_PROFILE_SCOPES 256
+#endif
+
+struct jp_profile_counters
+{
+   unsigned long calls; // times the scope was entered
+   unsigned long allocs;
+   unsigned long frees;
+   unsigned long bytes; // bytes requested
+   unsigned long long ns; // time spent inside the allocator
+};
+
+void jp_profile_begin(const char *name);
+void jp_profile_end();
+bool jp_profile_get(const char *name, jp_profile_counters *counters);
+void jp_profile_foreach(void (*fn)(const char *name, const jp_profile_counters &counters, void *arg), void *arg);
+
+// Internal fragmentation, sampled. id is a pool id, or the pool count for page
+// allocations. granted includes the block header. Only available when the
+// allocator is built with stats, returns false otherwise.
+
+struct jp_frag_counters
+{
+   unsigned long long requested;
+   unsigned long long granted;
+};
+
+bool jp_frag_get(size_t id, jp_frag_counters *counters);
+
+// Heap walk. Calls fn for every allocated block with its usable size and pool
+// id, the pool count for page allocations. The allocator is stopped during
+// the walk, fn must not allocate or free. Returns false if the walk could not
+// run.
+
+bool jp_heap_walk(void (*fn)(void *ptr, size_t size, size_t id, void *arg), void *arg);
+
+// Self tuning controller.
+// An optional background thread that samples the allocator every interval_ms
+// and adjusts the top pool refill batch between min_refill and max_refill:
+// it grows the batch while refill syscalls exceed target_refill_rate per
+// second and shrinks it when they drop well below it, or when RSS goes over
+// max_rss. Decisions are logged to log_fd. Also started at load when the
+// JP_ALLOC_TUNE environment variable is set.
+
+struct jp_tune_config
+{
+   unsigned interval_ms = 1000;
+   unsigned long target_refill_rate = 50; // per second
+   size_t min_refill = 1;
+   size_t max_refill = 64;
+   size_t max_rss = 0; // bytes, 0 for 90% of the container memory limit if any
+   int log_fd = 2; // -1 to disable logging
+};
+
+bool jp_tune_start(const jp_tune_config &config);
+void jp_tune_stop();
+
+// Container resources.
+// The cpus and memory the process may use: the online cpus narrowed by the
+// cgroup v2 cpuset.cpus.effective and cpu.max quota, and the tightest
+// memory.max up the cgroup tree, 0 if unlimited. Read at load and on every
+// tuner tick. A process in a cgroup below the root also re-reads them once a
+// second on a background thread, started at load and again in forked
+// children. The page cache spreads over that many cpus and keeps at most 1/64
+// of the memory limit, and a tuner without max_rss keeps RSS under 90% of it.
+
+struct jp_resources
+{
+   unsigned cpus = 1;
+   size_t memory = 0;
+};
+
+jp_resources jp_resources_get();
+
+// Page population.
+// When enabled, spans reserved for the pools while allocation demand is
+// sustained (the previous reservation was less than window_us ago) are
+// prefaulted in one go with MADV_POPULATE_WRITE, on a background thread if
+// background is set. Kernels without it get the span mapped with MAP_POPULATE
+// instead. Also started at load when JP_ALLOC_POPULATE is set.
+
+struct jp_populate_config
+{
+   unsigned window_us = 10000;
+   bool background = true;
+};
+
+bool jp_populate_start(const jp_populate_config &config);
+void jp_populate_stop();
+
+// Huge page collapse.
+// Pool spans are never unmapped, so a 2 MB region fully covered by them stays
+// put. A background thread checks such regions every interval_ms and
+// collapses those mapped for min_age_ms with at least min_density percent of
+// their pages resident into a huge page with MADV_COLLAPSE (linux 6.1),
+// instead of waiting for khugepaged. Sparse regions are left alone, collapsing
+// them would fault in the rest. Also started at load with JP_ALLOC_COLLAPSE=1.
+
+struct jp_collapse_config
+{
+   unsigned interval_ms = 1000;
+   unsigned min_age_ms = 5000;
+   unsigned min_density = 75;
+};
+
+bool jp_collapse_start(const jp_collapse_config &config);
+void jp_collapse_stop();
+unsigned long jp_collapse_count(); // regions promoted to huge pages
+
+// Heap timeline trace.
+// A background thread writes Chrome trace JSON (array format, loads in
+// Perfetto and chrome://tracing, also when cut short) to path: heap counters
+// every interval_ms, the flight recorder's slow path events, and one in
+// sample_rate allocations (0 for none). Timestamps are CLOCK_MONOTONIC in
+// microseconds and pid is the real pid, so the trace overlays application
+// traces on the same clock. Also started at load with JP_ALLOC_TRACE=path.
+
+struct jp_trace_config
+{
+   const char *path = nullptr;
+   unsigned interval_ms = 100;
+   unsigned sample_rate = 4096;
+};
+
+bool jp_trace_start(const jp_trace_config &config);
+void jp_trace_stop();
+
+// Flight recorder.
+// Slow path events (backend maps and unmaps, failed maps, tuner decisions) go
+// to a ring buffer in a memfd mapping, created on the first event. The last
+// JP_FLIGHT_EVENTS events can be found from a core dump via jp_flight_recorder,
+// or read from /proc/<pid>/fd while the process runs. Pooled allocations and
+// frees never record.
+
+#ifndef JP_FLIGHT_EVENTS
+#define JP_FLIGHT_EVENTS 4096
+#endif
+
+enum jp_flight_type : unsigned
+{
+   jp_flight_map = 1, // size bytes mapped at addr
+   jp_flight_unmap,
+   jp_flight_map_failed,
+   jp_flight_tune, // size is the new top pool refill batch
+   jp_flight_remap, // page allocation moved or resized to size bytes at addr
+   jp_flight_sample, // sampled allocation of size bytes, trace ring only
+   jp_flight_collapse, // size bytes at addr collapsed into a huge page
+};
+
+struct jp_flight_event
+{
+   std::atomic<unsigned long> seq; // event number + 1, set once the event is written
+   unsigned long long ns; // CLOCK_MONOTONIC
+   unsigned type;
+   unsigned tid;
+   size_t size;
+   void *addr;
+};
+
+struct jp_flight
+{
+   char magic[8]; // "JPFLIGHT"
+   unsigned long capacity;
+   std::atomic<unsigned long> next;
+   jp_flight_event events[1]; // capacity events
+};
+
+extern jp_flight *jp_flight_recorder;
+void jp_flight_dump(int fd);
+
+class jp_profile_scope
+{
+public:
+   explicit jp_profile_scope(const char *name) { jp_profile_begin(name); }
+   ~jp_profile_scope() { jp_profile_end(); }
+   jp_profile_scope(const jp_profile_scope &) = delete;
+   jp_profile_scope &operator=(const jp_profile_scope &) = delete;
+};
+
+namespace jp {
+
+// Growable array whose capacity is always the full size of its block, so no
+// slack is wasted. Trivially copyable elements grow through jp_realloc, which
+// keeps the block or remaps it without copying where it can; other types are
+// moved into a new block.
+template <class T>
+class vector
+{
+public:
+   using value_type = T;
+   using iterator = T*;
+   using const_iterator = const T*;
+
+   vector() = default;
+   explicit vector(size_t n) { resize(n); }
+   vector(const vector &other) { append(other.begin(), other.size()); }
+   vector(vector &&other) noexcept : mem(other.mem), count(other.count), cap(other.cap) { other.mem = nullptr, other.count = other.cap = 0; }
+   ~vector() { clear(); jp_free(mem); }
+
+   vector &operator=(vector other) noexcept
+   {
+      std::swap(mem, other.mem);
+      std::swap(count, other.count);
+      std::swap(cap, other.cap);
+      return *this;
+   }
+
+   T *data() { return mem; }
+   const T *data() const { return mem; }
+   size_t size() const { return count; }
+   size_t capacity() const { return cap; }
+   size_t max_size() const { return SIZE_MAX / sizeof(T); }
+   bool empty() const { return count == 0; }
+   T &operator[](size_t i) { return mem[i]; }
+   const T &operator[](size_t i) const { return mem[i]; }
+   T &back() { return mem[count - 1]; }
+   iterator begin() { return mem; }
+   iterator end() { return mem + count; }
+   const_iterator begin() const { return mem; }
+   const_iterator end() const { return mem + count; }
+
+   void reserve(size_t n)
+   {
+      if (n <= cap) return;
+      if (n > max_size()) throw std::length_error("jp::vector::reserve");
+      const size_t bytes = jp_good_size(n * sizeof(T));
+      T *p;
+      if (std::is_trivially_copyable<T>::value) {
+         p = static_cast<T*>(jp_realloc(mem, bytes));
+         if (p == nullptr) throw std::bad_alloc();
+      }
+      else {
+         p = static_cast<T*>(jp_alloc(bytes));
+         if (p == nullptr) throw std::bad_alloc();
+         for (size_t i = 0; i < count; ++i) {
+            new (p + i) T(std::move(mem[i]));
+            mem[i].~T();
+         }
+         jp_free(mem);
+      }
+      mem = p;
+      cap = bytes / sizeof(T);
+   }
+
+   template <class... Args> T &emplace_back(Args &&... args)
+   {
+      if (unlikely(count == cap)) {
+         // args may refer to an element, so build it before reserve
+         // releases the old storage
+         T v(std::forward<Args>(args)...);
+         reserve(cap ? cap * 2 : 1);
+         return *new (mem + count++) T(std::move(v));
+      }
+      return *new (mem + count++) T(std::forward<Args>(args)...);
+   }
+
+   void push_back(const T &v) { emplace_back(v); }
+   void push_back(T &&v) { emplace_back(std::move(v)); }
+   void pop_back() { mem[--count].~T(); }
+
+   void append(const T *p, size_t n)
+   {
+      if (n > max_size() - count) throw std::length_error("jp::vector::append");
+      if (count + n > cap && p < mem + count && p + n > mem) {
+         // p is in the storage reserve releases, copy it out first
+         vector copy;
+         copy.append(p, n);
+         return append(copy.begin(), n);
+      }
+      reserve(count + n);
+      for (size_t i = 0; i < n; ++i) new (mem + count + i) T(p[i]);
+      count += n;
+   }
+
+   void resize(size_t n)
+   {
+      reserve(n);
+      while (count < n) new (mem + count++) T();
+      while (count > n) mem[--count].~T();
+   }
+
+   void clear()
+   {
+      while (count > 0) mem[--count].~T();
+   }
+
+private:
+   T *mem = nullptr;
+   size_t count = 0;
+   size_t cap = 0;
+};
+
+using buffer = vector<char>;
+
+} // namespace jp
+
+#endif
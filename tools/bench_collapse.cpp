@@ -0,0 +1,92 @@
+// Pointer chasing over small pooled blocks before and after huge page collapse,
+// with dTLB load misses from perf_event_open when the host exposes them.
+//
+// build: g++ -O2 -I. tools/bench_collapse.cpp jp_alloc.so -Wl,-rpath,. -o bench_collapse
+// usage: ./bench_collapse [nodes] [steps]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "jp_alloc.h"
+
+struct node
+{
+   node *next;
+   char pad[40];
+};
+
+static int dtlb_counter()
+{
+   perf_event_attr attr;
+   memset(&attr, 0, sizeof(attr));
+   attr.size = sizeof(attr);
+   attr.type = PERF_TYPE_HW_CACHE;
+   attr.config = PERF_COUNT_HW_CACHE_DTLB | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+   attr.disabled = 1;
+   attr.exclude_kernel = 1;
+   attr.exclude_hv = 1;
+   return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void run(const char *name, int fd, node *head, size_t steps)
+{
+   long long misses = 0;
+   if (fd >= 0) {
+      ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+      ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+   }
+   auto start = std::chrono::steady_clock::now();
+   node *n = head;
+   for (size_t i = 0; i < steps; ++i) n = n->next;
+   double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+   if (fd >= 0) {
+      ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+      if (read(fd, &misses, sizeof(misses)) != sizeof(misses)) misses = -1;
+   }
+   if (n == nullptr) abort();
+   if (fd >= 0) printf("%-10s %.3f s  %lld dTLB misses\n", name, s, misses);
+   else printf("%-10s %.3f s  dTLB misses n/a\n", name, s);
+}
+
+int main(int argc, char **argv)
+{
+   size_t nodes = argc > 1 ? strtoul(argv[1], nullptr, 0) : 4000000;
+   size_t steps = argc > 2 ? strtoul(argv[2], nullptr, 0) : 20000000;
+
+   // a ring through all nodes in random order, so every step is a likely TLB miss
+   std::vector<node*> v(nodes);
+   for (auto &p : v) p = static_cast<node*>(malloc(sizeof(node)));
+   std::shuffle(v.begin(), v.end(), std::mt19937(1));
+   for (size_t i = 0; i < nodes; ++i) v[i]->next = v[(i + 1) % nodes];
+
+   int fd = dtlb_counter();
+   run("4k pages", fd, v[0], steps);
+
+   jp_collapse_config config;
+   config.interval_ms = 10;
+   config.min_age_ms = 0;
+   if (!jp_collapse_start(config)) {
+      printf("MADV_COLLAPSE not supported\n");
+      return 1;
+   }
+   // wait for a full pass without new promotions
+   unsigned long count;
+   do {
+      count = jp_collapse_count();
+      usleep(200000);
+   } while (jp_collapse_count() != count);
+   jp_collapse_stop();
+   printf("promoted %lu huge pages\n", count);
+
+   run("collapsed", fd, v[0], steps);
+   return 0;
+}
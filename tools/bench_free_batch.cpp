@@ -0,0 +1,72 @@
+// Freeing a large set of blocks in random order, one jp_free at a time
+// against one jp_free_batch, and walking blocks allocated again afterwards.
+//
+// build: g++ -O2 -I. tools/bench_free_batch.cpp jp_alloc.so -Wl,-rpath,. -o bench_free_batch
+// usage: ./bench_free_batch [blocks] [rounds]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "jp_alloc.h"
+
+static double seconds(std::chrono::steady_clock::time_point start)
+{
+   return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+constexpr size_t node_size = 48;
+
+// blocks returned in random order, like the nodes of a hash table
+static void fill(std::vector<void*> &v, std::mt19937 &rng)
+{
+   for (auto &p : v) {
+      p = jp_alloc(node_size);
+      *static_cast<volatile char*>(p) = 1;
+   }
+   std::shuffle(v.begin(), v.end(), rng);
+}
+
+// touch blocks allocated after the free, in allocation order
+static double reuse(std::vector<void*> &v)
+{
+   auto start = std::chrono::steady_clock::now();
+   for (auto &p : v) {
+      p = jp_alloc(node_size);
+      *static_cast<volatile char*>(p) = 1;
+   }
+   for (int r = 0; r < 8; ++r) {
+      for (void *p : v) ++*static_cast<volatile char*>(p);
+   }
+   double s = seconds(start);
+   for (void *p : v) jp_free(p);
+   return s;
+}
+
+int main(int argc, char **argv)
+{
+   size_t blocks = argc > 1 ? strtoul(argv[1], nullptr, 0) : 2000000;
+   size_t rounds = argc > 2 ? strtoul(argv[2], nullptr, 0) : 5;
+   std::mt19937 rng(1);
+   std::vector<void*> v(blocks);
+   double free_one = 0, free_batch = 0, reuse_one = 0, reuse_batch = 0;
+   for (size_t r = 0; r < rounds; ++r) {
+      fill(v, rng);
+      auto start = std::chrono::steady_clock::now();
+      for (void *p : v) jp_free(p);
+      free_one += seconds(start);
+      reuse_one += reuse(v);
+
+      fill(v, rng);
+      start = std::chrono::steady_clock::now();
+      jp_free_batch(v.data(), v.size());
+      free_batch += seconds(start);
+      reuse_batch += reuse(v);
+   }
+   printf("%zu blocks x %zu  jp_free %.3f s  jp_free_batch %.3f s  %+.0f%%\n", blocks, rounds, free_one, free_batch, (free_batch / free_one - 1) * 100);
+   printf("reuse after   jp_free %.3f s  jp_free_batch %.3f s  %+.0f%%\n", reuse_one, reuse_batch, (reuse_batch / reuse_one - 1) * 100);
+   return 0;
+}
@@ -0,0 +1,62 @@
+// Throughput of every bulk memory kernel variant the host cpu supports, for
+// calloc zeroing and realloc copy sizes around nt_bytes.
+//
+// build: g++ -O2 -I. tools/bench_kernels.cpp -o bench_kernels
+// usage: ./bench_kernels [max_mb]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "jp_alloc.h"
+
+struct variant
+{
+   const char *name;
+   bool supported;
+   void (*zero)(void *, size_t);
+   void (*copy)(void *, const void *, size_t);
+};
+
+template <class F>
+static double gbps(size_t bytes, F fn)
+{
+   const size_t reps = std::max<size_t>(1, (size_t(2) << 30) / bytes);
+   auto start = std::chrono::steady_clock::now();
+   for (size_t i = 0; i < reps; ++i) fn();
+   double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+   return bytes * reps / s / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+   const size_t max = (argc > 1 ? strtoul(argv[1], nullptr, 0) : 256) << 20;
+   variant variants[] = {
+      { "generic", true, jp::zero_generic, jp::copy_generic },
+#if defined(__x86_64__)
+      { "sse2", __builtin_cpu_supports("sse2") != 0, jp::zero_sse2, jp::copy_sse2 },
+      { "avx2", __builtin_cpu_supports("avx2") != 0, jp::zero_avx2, jp::copy_avx2 },
+      { "avx512", __builtin_cpu_supports("avx512f") != 0, jp::zero_avx512, jp::copy_avx512 },
+#endif
+   };
+   char *a = static_cast<char*>(malloc(max)), *b = static_cast<char*>(malloc(max));
+   memset(a, 1, max);
+   memset(b, 1, max);
+   printf("%-8s %10s %12s %12s\n", "kernel", "bytes", "zero GB/s", "copy GB/s");
+   for (size_t bytes = 64 << 10; bytes <= max; bytes *= 4) {
+      for (const variant &v : variants) {
+         if (!v.supported) {
+            printf("%-8s %10zu %12s %12s\n", v.name, bytes, "n/a", "n/a");
+            continue;
+         }
+         double z = gbps(bytes, [&] { v.zero(b, bytes); });
+         double c = gbps(bytes, [&] { v.copy(b, a, bytes); });
+         printf("%-8s %10zu %12.1f %12.1f\n", v.name, bytes, z, c);
+      }
+   }
+   free(a);
+   free(b);
+   return 0;
+}
@@ -0,0 +1,58 @@
+// Node container churn through operator new, the path the callsite size
+// class cache serves. Compare builds of jp_alloc.so with the default and
+// with -DJP_ALLOC_SITE_CACHE=1024.
+//
+// build: g++ -O2 tools/bench_new.cpp jp_alloc.so -Wl,-rpath,. -o bench_new
+// usage: ./bench_new [operations]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <list>
+#include <map>
+#include <memory>
+#include <unordered_map>
+
+template <class F>
+static void run(const char *name, F fn)
+{
+   auto start = std::chrono::steady_clock::now();
+   size_t check = fn();
+   double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+   printf("%-14s %.3f s  (%zu)\n", name, s, check);
+}
+
+int main(int argc, char **argv)
+{
+   const size_t ops = argc > 1 ? strtoul(argv[1], nullptr, 0) : 10000000;
+   run("std::map", [&] {
+      std::map<int, int> m;
+      for (size_t i = 0; i < ops; ++i) {
+         m[i & 0xffff] = i;
+         if (i & 1) m.erase((i * 7) & 0xffff);
+      }
+      return m.size();
+   });
+   run("unordered_map", [&] {
+      std::unordered_map<int, int> m;
+      for (size_t i = 0; i < ops; ++i) {
+         m[i & 0xffff] = i;
+         if (i & 1) m.erase((i * 7) & 0xffff);
+      }
+      return m.size();
+   });
+   run("std::list", [&] {
+      std::list<size_t> l;
+      for (size_t i = 0; i < ops; ++i) {
+         l.push_back(i);
+         if (l.size() > 1000) l.pop_front();
+      }
+      return l.size();
+   });
+   run("make_shared", [&] {
+      size_t sum = 0;
+      for (size_t i = 0; i < ops; ++i) sum += *std::make_shared<size_t>(i) & 1;
+      return sum;
+   });
+   return 0;
+}
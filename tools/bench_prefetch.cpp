@@ -0,0 +1,55 @@
+// Allocation from large, shuffled freelists, where every pop follows a next
+// pointer into a cold block. Uses the template core directly; build it twice
+// to compare pop with and without the freelist prefetch.
+//
+// build: g++ -O2 -I. tools/bench_prefetch.cpp -o bench_prefetch
+//        g++ -O2 -I. -DJP_ALLOC_PREFETCH=0 tools/bench_prefetch.cpp -o bench_prefetch_off
+// usage: ./bench_prefetch [blocks] [rounds]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "jp_alloc.h"
+
+template <class Sync>
+using bench_allocator = jp::pool_allocator<jp::pow2_classes<16>, Sync, jp::mmap_pages, jp::no_stats>;
+
+template <class Sync>
+static void run(const char *name, size_t blocks, size_t rounds)
+{
+   static bench_allocator<Sync> a;
+   std::vector<void*> v(blocks);
+   std::mt19937 rng(1);
+   double s = 0;
+   size_t sum = 0;
+   for (size_t r = 0; r < rounds; ++r) {
+      // free in random order, so the list links blocks all over the spans
+      for (auto &p : v) p = a.alloc(48);
+      std::shuffle(v.begin(), v.end(), rng);
+      for (void *p : v) a.free(p);
+      auto start = std::chrono::steady_clock::now();
+      for (auto &p : v) {
+         p = a.alloc(48);
+         memset(p, int(r), 48);
+         sum += *static_cast<unsigned char*>(p);
+      }
+      s += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      for (void *p : v) a.free(p);
+   }
+   printf("%-20s %zu blocks x %zu  %.3f s  %.1f ns/alloc  (%zu)\n", name, blocks, rounds, s, s * 1e9 / (blocks * rounds), sum);
+}
+
+int main(int argc, char **argv)
+{
+   size_t blocks = argc > 1 ? strtoul(argv[1], nullptr, 0) : 4000000;
+   size_t rounds = argc > 2 ? strtoul(argv[2], nullptr, 0) : 5;
+   printf("prefetch %s\n", JP_ALLOC_PREFETCH ? "on" : "off");
+   run<jp::single_thread_sync>("single_thread_sync", blocks, rounds);
+   run<jp::atomic_sync>("atomic_sync", blocks, rounds);
+   return 0;
+}
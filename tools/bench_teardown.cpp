@@ -0,0 +1,48 @@
+// Teardown time with and without jp_fast_exit.
+//
+// build: g++ -O2 -I. tools/bench_teardown.cpp jp_alloc.so -Wl,-rpath,. -o bench_teardown
+// usage: ./bench_teardown [objects]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "jp_alloc.h"
+
+// build a heap like a long running service would, then time the destructors
+static double teardown(size_t objects, bool fast)
+{
+   auto *m = new std::map<size_t, std::string>;
+   for (size_t i = 0; i < objects; ++i) m->emplace(i * 2654435761U, std::string(i % 64 + 24, 'x'));
+   auto start = std::chrono::steady_clock::now();
+   if (fast) jp_fast_exit();
+   delete m;
+   return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char **argv)
+{
+   size_t objects = argc > 1 ? strtoul(argv[1], nullptr, 0) : 2000000;
+   for (bool fast : { false, true }) {
+      // fast exit can't be undone, so each run gets its own process
+      int fd[2];
+      if (pipe(fd) != 0) return 1;
+      pid_t pid = fork();
+      if (pid == 0) {
+         double t = teardown(objects, fast);
+         if (write(fd[1], &t, sizeof(t)) != sizeof(t)) _exit(1);
+         _exit(0);
+      }
+      double t = 0;
+      if (read(fd[0], &t, sizeof(t)) != sizeof(t)) return 1;
+      waitpid(pid, nullptr, 0);
+      close(fd[0]);
+      close(fd[1]);
+      printf("%-9s %zu objects: teardown %.3f s\n", fast ? "fast exit" : "normal", objects, t);
+   }
+   return 0;
+}
@@ -0,0 +1,45 @@
+// push_back throughput of jp::vector against std::vector, both on jp_alloc.
+//
+// build: g++ -O2 -I. tools/bench_vector.cpp jp_alloc.so -Wl,-rpath,. -o bench_vector
+// usage: ./bench_vector [elements] [rounds]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "jp_alloc.h"
+
+template <class V, class T>
+static double run(size_t elements, size_t rounds, const T &value)
+{
+   auto start = std::chrono::steady_clock::now();
+   size_t sum = 0;
+   for (size_t r = 0; r < rounds; ++r) {
+      V v;
+      for (size_t i = 0; i < elements; ++i) v.push_back(value);
+      sum += v.size();
+   }
+   if (sum != elements * rounds) abort();
+   return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+template <class T>
+static void compare(const char *name, size_t elements, size_t rounds, const T &value)
+{
+   double s = run<std::vector<T>>(elements, rounds, value);
+   double j = run<jp::vector<T>>(elements, rounds, value);
+   printf("%-12s %10zu x %-5zu std::vector %.3f s  jp::vector %.3f s  %+.0f%%\n", name, elements, rounds, s, j, (j / s - 1) * 100);
+}
+
+int main(int argc, char **argv)
+{
+   size_t elements = argc > 1 ? strtoul(argv[1], nullptr, 0) : 10000000;
+   size_t rounds = argc > 2 ? strtoul(argv[2], nullptr, 0) : 10;
+   compare("char", elements, rounds, 'x');
+   compare("int", elements, rounds, 42);
+   compare("small vector", elements / 100, rounds * 100, 42);
+   compare("std::string", elements / 10, rounds, std::string("jp_alloc"));
+   return 0;
+}
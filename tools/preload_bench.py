@@ -0,0 +1,140 @@
+#!/usr/bin/env python3
+# Run allocation heavy programs with and without LD_PRELOAD=jp_alloc.so and
+# compare exit status, output, wall time and peak RSS.
+#
+# usage: tools/preload_bench.py [--lib jp_alloc.so] [--runs 3] [--threshold 0.10]
+#
+# Programs not available on the host are skipped. Exits with 1 if any
+# workload fails, differs in output or regresses by more than threshold.
+
+import argparse
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+PY_ALLOC = r'''
+import random
+random.seed(1)
+d = {}
+for i in range(400000):
+    d[i] = str(i) * (i % 7 + 1)
+    if i % 3 == 0: d.pop(random.randrange(i + 1), None)
+l = [[j for j in range(i % 50)] for i in range(100000)]
+s = sorted(d.values())
+print(len(d), len(l), s[0], s[-1])
+'''
+
+PY_SQLITE = r'''
+import sqlite3, sys
+db = sqlite3.connect(sys.argv[1])
+db.execute("create table t(a integer, b text)")
+db.executemany("insert into t values(?, ?)", ((i, "x" * (i % 300)) for i in range(200000)))
+db.execute("create index ta on t(b)")
+db.commit()
+print(db.execute("select count(*), sum(length(b)) from t where b > 'xx'").fetchone())
+'''
+
+SQLITE_SQL = '''
+create table t(a integer, b text);
+with recursive c(i) as (select 1 union all select i + 1 from c where i < 200000)
+insert into t select i, substr(hex(randomblob(160)), 1, i % 300) from c;
+create index ta on t(b);
+select count(*), sum(length(b)) from t where a % 7 = 0;
+'''
+
+
+def large_tu(path):
+    with open(path, 'w') as f:
+        f.write('#include <map>\n#include <string>\n#include <vector>\n#include <functional>\n')
+        for i in range(400):
+            f.write('std::map<std::string, std::vector<int>> f%d(int n) { std::map<std::string, std::vector<int>> m; '
+                    'for (int i = 0; i < n; ++i) m[std::to_string(i * %d)].push_back(i); return m; }\n' % (i, i))
+        f.write('int main() { return f0(1).size() == 1 ? 0 : 1; }\n')
+
+
+def workloads(tmp):
+    w = [('python alloc', [sys.executable, '-c', PY_ALLOC], None, True)]
+    if shutil.which('sqlite3'):
+        w.append(('sqlite3 shell', ['sqlite3', os.path.join(tmp, 'shell.db')], SQLITE_SQL, False))
+    else:
+        w.append(('python sqlite3', [sys.executable, '-c', PY_SQLITE, os.path.join(tmp, 'py.db')], None, True))
+    cxx = shutil.which('g++') or shutil.which('clang++')
+    if cxx:
+        tu = os.path.join(tmp, 'large_tu.cpp')
+        large_tu(tu)
+        w.append(('%s large TU' % os.path.basename(cxx), [cxx, '-O2', '-c', tu, '-o', os.path.join(tmp, 'large_tu.o')], None, True))
+    return w
+
+
+def measure(cmd, stdin, env, runs, cleanup):
+    walls, rss = [], 0
+    code, out, err = 0, b'', b''
+    for _ in range(runs):
+        for p in cleanup:
+            if os.path.exists(p): os.unlink(p)
+        start = time.monotonic()
+        # stderr goes to a file so a chatty child can't block on a full pipe,
+        # and the child is reaped with wait4 to get its own rusage
+        with tempfile.TemporaryFile() as errf:
+            proc = subprocess.Popen(cmd, env=env, stdin=subprocess.PIPE if stdin else subprocess.DEVNULL,
+                                    stdout=subprocess.PIPE, stderr=errf)
+            if stdin:
+                proc.stdin.write(stdin.encode())
+                proc.stdin.close()
+            out = proc.stdout.read()
+            _, status, ru = os.wait4(proc.pid, 0)
+            proc.returncode = status
+            errf.seek(0)
+            err = errf.read()
+        walls.append(time.monotonic() - start)
+        rss = max(rss, ru.ru_maxrss)
+        code = os.waitstatus_to_exitcode(status)
+        if code != 0: break
+    walls.sort()
+    return code, out, err, walls[len(walls) // 2], rss
+
+
+def main():
+    ap = argparse.ArgumentParser()
+    ap.add_argument('--lib', default=os.path.join(ROOT, 'jp_alloc.so'))
+    ap.add_argument('--runs', type=int, default=3)
+    ap.add_argument('--threshold', type=float, default=0.10, help='allowed relative slowdown / rss growth')
+    args = ap.parse_args()
+
+    lib = os.path.abspath(args.lib)
+    if not os.path.exists(lib):
+        cmd = ['g++', '-O2', '-shared', '-fPIC', os.path.join(ROOT, 'jp_alloc.cpp'), '-o', lib, '-lpthread']
+        print('building', lib)
+        subprocess.check_call(cmd)
+
+    failed = False
+    print('%-18s %8s %8s %7s %10s %10s %7s  %s' % ('workload', 'glibc s', 'jp s', 'time', 'glibc KB', 'jp KB', 'rss', 'status'))
+    with tempfile.TemporaryDirectory() as tmp:
+        for name, cmd, stdin, check_output in workloads(tmp):
+            cleanup = [a for a in cmd if a.endswith('.db') or a.endswith('.o')]
+            base_env = dict(os.environ)
+            base_env.pop('LD_PRELOAD', None)
+            jp_env = dict(base_env, LD_PRELOAD=lib)
+            b = measure(cmd, stdin, base_env, args.runs, cleanup)
+            j = measure(cmd, stdin, jp_env, args.runs, cleanup)
+            notes = []
+            if j[0] != b[0]: notes.append('EXIT %d vs %d' % (j[0], b[0]))
+            if check_output and j[1] != b[1]: notes.append('OUTPUT DIFFERS')
+            t = j[3] / b[3] - 1 if b[3] else 0
+            r = j[4] / b[4] - 1 if b[4] else 0
+            if t > args.threshold: notes.append('SLOWER')
+            if r > args.threshold: notes.append('MORE RSS')
+            failed |= bool(notes)
+            print('%-18s %8.2f %8.2f %+6.0f%% %10d %10d %+6.0f%%  %s' %
+                  (name, b[3], j[3], t * 100, b[4], j[4], r * 100, ', '.join(notes) or 'ok'))
+            if j[0] != 0: sys.stdout.write(j[2].decode(errors='replace')[-2000:])
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
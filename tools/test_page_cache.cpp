@@ -0,0 +1,43 @@
+// Regression test: a dirty block recycled by the page cache must not reach
+// the allocator's own tables, which rely on zeroed memory. Used to hang in
+// the live page registry's probe loop.
+//
+// build: g++ -O2 -I. tools/test_page_cache.cpp jp_alloc.so -Wl,-rpath,. -o test_page_cache
+// usage: ./test_page_cache, prints ok and exits 0, or fails within 10 s
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <sched.h>
+#include <unistd.h>
+
+#include "jp_alloc.h"
+
+int main()
+{
+   alarm(10); // a hang fails the test
+   // one cpu, so every free and alloc goes through the same cache shard
+   cpu_set_t cpus;
+   CPU_ZERO(&cpus);
+   CPU_SET(sched_getcpu(), &cpus);
+   sched_setaffinity(0, sizeof(cpus), &cpus);
+
+   // a cached block the size of a 64 KB table, full of garbage
+   void *dirty = jp_alloc(65504);
+   memset(dirty, 0xab, 65504);
+   jp_free(dirty);
+
+   // enough live page allocations to grow the registry to 64 KB
+   std::vector<void*> live(2100);
+   for (auto &p : live) {
+      p = jp_alloc(40000);
+      if (p == nullptr) return 1;
+   }
+   for (void *p : live) jp_free(p);
+
+   // an aligned allocation's freed block must be reusable by size
+   for (int i = 0; i < 100; ++i) jp_free(jp_alloc_aligned(8192, 100000));
+
+   printf("ok\n");
+   return 0;
+}
@@ -0,0 +1,74 @@
+// Regression test: heap walks while other threads refill, split and resize.
+// Walks used to see half carved spans, reporting phantom blocks with class
+// ids below the smallest block and usable sizes that wrapped.
+//
+// build: g++ -O2 -pthread -I. tools/test_walk.cpp jp_alloc.so -Wl,-rpath,. -o test_walk
+// usage: ./test_walk [walks], prints ok and exits 0, or fails within 60 s
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <thread>
+#include <vector>
+#include <sched.h>
+#include <unistd.h>
+
+#include "jp_alloc.h"
+
+struct check
+{
+   size_t min_size; // usable size of the smallest real block
+   size_t blocks;
+   size_t bad;
+};
+
+int main(int argc, char **argv)
+{
+   alarm(60); // a hang fails the test
+   const size_t walks = argc > 1 ? strtoul(argv[1], nullptr, 0) : 2000;
+   std::atomic<bool> stop = {false};
+   std::atomic<unsigned> running = {0};
+   std::vector<std::thread> threads;
+   for (unsigned t = 0; t < 4; ++t) {
+      threads.emplace_back([&stop, &running, t] {
+         std::mt19937 rng(t);
+         std::vector<void*> v(4096);
+         bool counted = false;
+         for (unsigned r = 0; !stop.load(std::memory_order_relaxed); ++r) {
+            // a size band that moves every round, so pools keep running
+            // empty and splitting or refilling, and user data that reads as
+            // small class ids if a walk takes it for a header
+            const size_t band = 16 << r % 8;
+            jp_expect(band, 64);
+            for (auto &p : v) {
+               const size_t size = band + rng() % band;
+               p = jp_alloc(size);
+               memset(p, r % 4, size);
+            }
+            for (size_t i = 0; i < 64; ++i) v[i] = jp_realloc(v[i], 1 + rng() % 300000);
+            for (void *p : v) jp_free(p);
+            if (!counted) counted = true, running++;
+         }
+      });
+   }
+   while (running < threads.size()) sched_yield();
+   check c = { jp_good_size(1), 0, 0 };
+   for (size_t i = 0; i < walks && c.bad == 0; ++i) {
+      bool ok = jp_heap_walk([](void *ptr, size_t size, size_t id, void *arg) {
+         check *c = static_cast<check*>(arg);
+         c->blocks++;
+         if (size < c->min_size || size > (size_t(1) << 40) || uintptr_t(ptr) % 16 != 0) {
+            if (c->bad++ == 0) printf("bad block %p size %zu id %zu\n", ptr, size, id);
+         }
+      }, &c);
+      if (!ok) c.bad++;
+   }
+   stop = true;
+   for (auto &t : threads) t.join();
+   if (c.bad) return 1;
+   printf("ok, %zu blocks walked\n", c.blocks);
+   return 0;
+}